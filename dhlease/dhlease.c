@@ -33,14 +33,25 @@ either expressed or implied, of the DHLEASE project.
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <getopt.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/param.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "libdhlease.h"
 #include "dhlease.h"
 
-static FILE *fp;
 static char *prog;
-static int  token;	/* contains the current valid token */
-static int  inblock;	/* indicates whether we are inside a lease block */
 
 /* Program options */
 static const char *opts = "haxf:i:m:c:vd";
@@ -56,35 +67,90 @@ static int  vflag;
 static char *cval;
 static char *mval;
 static char *ival;
+static char *colval;
+static int  atflag;
+static int  betweenflag;
+static int  diffflag;
+static int  diffsinceflag;
+static time_t tfrom;
+static time_t tto;
+static char *diffold;
+static char *diffnew;
+static int  memlimitflag;
+static int  conflictsflag;
+static int  pipelineflag;
+static int  pipelining;		/* --pipeline threads are running */
+static size_t memlimit;
+
+static const struct option longopts[] = {
+	{ "at",		required_argument,	NULL,	OPT_AT },
+	{ "between",	required_argument,	NULL,	OPT_BETWEEN },
+	{ "diff",	required_argument,	NULL,	OPT_DIFF },
+	{ "diff-since",	required_argument,	NULL,	OPT_DIFF_SINCE },
+	{ "mem-limit",	required_argument,	NULL,	OPT_MEM_LIMIT },
+	{ "conflicts",	no_argument,		NULL,	OPT_CONFLICTS },
+	{ "pipeline",	no_argument,		NULL,	OPT_PIPELINE },
+	{ "columns",	required_argument,	NULL,	OPT_COLUMNS },
+	{ NULL,		0,			NULL,	0 }
+};
+
+/*
+ * Output columns, indexed by COL_*.  The widths start out fitting the
+ * titles and grow with the rows about to be shown.
+ */
+static struct column columns[COL_MAX] = {
+	{ "client",	"CLIENT",	measure_client,	 emit_client,	 sizeof("CLIENT") - 1,	    0 },
+	{ "ip",		"IP ADDRESS",	measure_ipaddr,	 emit_ipaddr,	 sizeof("IP ADDRESS") - 1,  0 },
+	{ "mac",	"MAC ADDRESS",	measure_macaddr, emit_macaddr,	 sizeof("MAC ADDRESS") - 1, 0 },
+	{ "starts",	"LEASE START",	measure_time,	 emit_start,	 sizeof("LEASE START") - 1, 0 },
+	{ "ends",	"LEASE END",	measure_time,	 emit_end,	 sizeof("LEASE END") - 1,   0 },
+	{ "expired",	"EXPIRED",	NULL,		 emit_expired,	 sizeof("EXPIRED") - 1,	    0 },
+	{ "state",	"STATE",	measure_state,	 emit_state,	 sizeof("STATE") - 1,	    0 },
+	{ "abandoned",	"ABANDONED",	NULL,		 emit_abandoned, sizeof("ABANDONED") - 1,   0 }
+};
+
+/* The columns to show, in order, as compiled by parse_columns() */
+static struct column *layout[COL_MAX];
+static size_t ncolumns;
+
+/* Rows are formatted here and written out in large blocks */
+static char outbuf[OUTBUF_SIZE];
+static size_t outlen;
+
+/* Interval indexes, built on first use and kept for later queries */
+static struct lease_index ipidx;
+static struct lease_index macidx;
+static const char *(*idxkey)(struct lease_t *);
 
-/* General purpose parser buffers */
-static char buffer[2048];
-static struct lease_t *lbuf;
-
-/* Line and character position */
-static int cpos;
-static int line;
-
-
-static const struct keywords {
-        const char      *name;
-        int             value;
-} keywords[] = {
-	      { "abandoned",		      TOK_ABANDONED },
-        { "client-hostname",    TOK_CLIENT_HOSTNAME },
-        { "ends",               TOK_ENDS },
-        { "ethernet",           TOK_ETHERNET },
-        { "hardware",           TOK_HARDWARE },
-        { "lease",              TOK_LEASE },
-        { "starts",             TOK_STARTS }
+/* Client hostnames of the leases kept in memory */
+static struct namepool names;
+
+/* Number of leases parsed so far, across all lease files */
+static size_t nleases;
+
+/* Changes found by --diff */
+static struct change *changes;
+static size_t nchanges;
+static size_t changecap;
+
+static const char *change_names[CHG_MAX] = {
+	"new", "released", "rebound", "moved", "renamed"
 };
 
+/* Conflicts found by --conflicts */
+static struct conflict *conflicts;
+static size_t nconflicts;
+static size_t conflictcap;
+
 
 static void
 usage(void)
 {
         fprintf(stderr, "%s -- dhcp lease viewer\n", prog);
         fprintf(stderr, "  usage: %s [-haxvd] [-f file...] [-i ip_addr] [-c client] [-m mac_addr]\n", prog);
+        fprintf(stderr, "         [--at time | --between time1 time2]\n");
+        fprintf(stderr, "         [--diff old_file new_file | --diff-since time] [--mem-limit size]\n");
+        fprintf(stderr, "         [--conflicts] [--pipeline] [--columns list]\n");
         fprintf(stderr, "   -h this help\n");
 	fprintf(stderr, "   -d remove duplicate MAC-leases; show only most recent lease\n");
         fprintf(stderr, "   -c [client] search for client\n");
@@ -94,10 +160,26 @@ usage(void)
         fprintf(stderr, "   -a show active leases, mutually exclusive with -x\n");
         fprintf(stderr, "   -x show expired leases, mutually exclusive with -a\n");
 	fprintf(stderr, "   -v slightly more verbose\n");
+	fprintf(stderr, "   --at [time] show leases held at the given time\n");
+	fprintf(stderr, "   --between [time1] [time2] show leases held at any time in the given range\n");
+	fprintf(stderr, "   --diff [old_file] [new_file] show what changed between two lease files\n");
+	fprintf(stderr, "   --diff-since [time] show what changed in the lease file since the given time\n");
+	fprintf(stderr, "   --mem-limit [size] sort by MAC address using at most size bytes of memory,\n");
+	fprintf(stderr, "                      spilling to temporary files; size may end in K, M or G\n");
+	fprintf(stderr, "   --conflicts show leases overlapping in time on the same IP or MAC address\n");
+	fprintf(stderr, "   --pipeline read, parse and write the leases in parallel, with fixed width columns\n");
+	fprintf(stderr, "   --columns [list] comma separated columns to show out of client, ip, mac,\n");
+	fprintf(stderr, "                    starts, ends, expired, state and abandoned\n");
+	fprintf(stderr, "   times are given as YYYY/MM/DD HH:MM:SS, YYYY-MM-DD [HH:MM[:SS]] or 'now'\n");
         exit(EXIT_FAILURE);
 }
 
 
+/*
+ * Report an error and exit.  While the --pipeline threads run, the
+ * output buffer may be in use by the writer, so the exit handlers that
+ * flush it are skipped.
+ */
 static int
 error(const char *fmt, ...)
 {
@@ -107,6 +189,8 @@ error(const char *fmt, ...)
 	(void)vfprintf(stderr, fmt, arglist);
 	va_end(arglist);
 
+	if (pipelining)
+		_exit(EXIT_FAILURE);
 	exit(EXIT_FAILURE);
 }
 
@@ -127,34 +211,173 @@ match_partial_string(const char *src, const char *search)
 
 
 /*
- * Converts a time_t to a string representation
+ * Returns 0 if search is contained within the raw lease field,
+ * otherwise -1.  This spares decoding fields which are only searched.
+ */
+static int
+match_partial_field(const struct dhl_field *f, const char *search)
+{
+	size_t i, n;
+
+	if (f->ptr == NULL || search == NULL)
+		return -1;
+
+	n = strlen(search);
+	for (i = 0; i + n <= f->len; i++) {
+		if (strncasecmp(f->ptr + i, search, n) == 0)
+			return 0;
+	}
+	return -1;
+}
+
+
+/*
+ * Converts a time_t to a string representation in tbuf, which must
+ * hold at least TIMESTR_LEN bytes.  The end of an infinite lease is
+ * shown as "never".
  */
 static char
-*time_to_string(const time_t *tt)
+*time_to_string(const time_t *tt, char *tbuf)
 {
-	char *tbuf;
 	struct tm tm;
 
-	tbuf = (char *)malloc(128);
-	strftime(tbuf, sizeof(tbuf), "%Y/%m%/%d %H:%M:%S", localtime_r(tt, &tm));
+	if (*tt == DHL_NEVER)
+		return strcpy(tbuf, "never");
+	return strtok(asctime_r(localtime_r(tt, &tm), tbuf), "\n");
+}
+
+
+/*
+ * Decode a raw string field of a lease.  Returns NULL if the lease did
+ * not carry the field.
+ */
+static char *
+decode_field(const struct dhl_field *f)
+{
+	char *str;
+
+	if (f->ptr == NULL)
+		return NULL;
+
+	if ((str = malloc(f->len + 1)) == NULL)
+		error("%s: out of memory\n", prog);
+	dhl_field_copy(f, str, f->len + 1);
 
-	return strtok(asctime_r(&tm, tbuf), "\n");
+	return str;
 }
 
 
 /*
- * Converts a textual representation of a date to a time_t
-*/
+ * Lease field accessors.  Fields are left as they are in the lease file
+ * until first asked for, so that only what gets filtered on, sorted by
+ * or shown is ever decoded.
+ */
+static time_t
+lease_start(struct lease_t *p)
+{
+	if (!(p->decoded & LEASE_START)) {
+		if (p->raw_start.ptr != NULL && dhl_field_time(&p->raw_start, &p->start) != DHL_OK)
+			error("%s: invalid start date in lease for %s\n", prog, lease_ipaddr(p));
+		p->decoded |= LEASE_START;
+	}
+	return p->start;
+}
+
+
+static time_t
+lease_end(struct lease_t *p)
+{
+	if (!(p->decoded & LEASE_END)) {
+		if (p->raw_end.ptr != NULL && dhl_field_time(&p->raw_end, &p->end) != DHL_OK)
+			error("%s: invalid end date in lease for %s\n", prog, lease_ipaddr(p));
+		p->decoded |= LEASE_END;
+	}
+	return p->end;
+}
+
+
+static const char *
+lease_client(struct lease_t *p)
+{
+	struct name *nm;
+
+	if (p->client_id == NAME_STREAM)
+		return ((struct stream_lease *)p)->client;
+	if (p->client_id == NAME_NONE)
+		return NULL;
+
+	nm = &names.ent[p->client_id];
+	if (nm->str == NULL)
+		nm->str = decode_field(&nm->raw);
+	return nm->str;
+}
+
+
+static const char *
+lease_ipaddr(struct lease_t *p)
+{
+	if (!(p->decoded & LEASE_IPADDR)) {
+		p->ipaddr = decode_field(&p->raw_ipaddr);
+		p->decoded |= LEASE_IPADDR;
+	}
+	return p->ipaddr;
+}
+
+
+static const char *
+lease_macaddr(struct lease_t *p)
+{
+	if (!(p->decoded & LEASE_MACADDR)) {
+		p->macaddr = decode_field(&p->raw_macaddr);
+		p->decoded |= LEASE_MACADDR;
+	}
+	return p->macaddr;
+}
+
+
+static const char *
+lease_state(struct lease_t *p)
+{
+	if (!(p->decoded & LEASE_STATE)) {
+		p->state = decode_field(&p->raw_state);
+		p->decoded |= LEASE_STATE;
+	}
+	return p->state;
+}
+
+
+/*
+ * Converts a time given on the command line to a time_t.  Accepts the
+ * format used in the lease file as well as a few ISO 8601 variants.
+ */
 static time_t
-string_to_time(const char *datestr)
+parse_time_arg(const char *arg)
 {
-	char *err;
+	static const char *formats[] = {
+		"%Y/%m/%d %H:%M:%S",
+		"%Y-%m-%d %H:%M:%S",
+		"%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d %H:%M",
+		"%Y-%m-%d"
+	};
+	char *end;
 	struct tm tm;
+	size_t i;
+
+	if (strcasecmp(arg, "now") == 0)
+		return time(NULL);
 
-	if ((err = strptime(datestr, "%Y/%m/%d %H:%M:%S", &tm)) == NULL)
-		error("%s: time conversion failed: %s\n", prog, datestr);
+	for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+		memset(&tm, 0, sizeof(tm));
+		end = strptime(arg, formats[i], &tm);
+		if (end != NULL && *end == '\0') {
+			tm.tm_isdst = -1;
+			return mktime(&tm);
+		}
+	}
 
-	return mktime(&tm);
+	error("%s: invalid time '%s'\n", prog, arg);
+	return -1;
 }
 
 
@@ -210,11 +433,11 @@ static void remove_duplicates(void)
 		return;
 
 	TAILQ_FOREACH(p_cur, &head, entities) {
-    if (p_cur->macaddr) {
+    if (lease_macaddr(p_cur)) {
 		  TAILQ_FOREACH(p_cur_sub, &head, entities) {
-        if (p_cur_sub->macaddr) {
+        if (lease_macaddr(p_cur_sub)) {
 			    if (strcasecmp(p_cur->macaddr, p_cur_sub->macaddr) == 0) {
-				    if (compare_time(p_cur->end, p_cur_sub->end) == -1) {
+				    if (compare_time(lease_end(p_cur), lease_end(p_cur_sub)) == -1) {
 					    TAILQ_REMOVE(&head, p_cur, entities);
 				    }
 			    }
@@ -229,499 +452,2004 @@ static void remove_duplicates(void)
 
 
 /*
- * Format, filter and show output
+ * Returns 1 if the lease passes all of the search and state filters
+ * given on the command line, otherwise 0
  */
-static void
-output_leases(const size_t cltlen, const size_t iplen, const size_t maclen, const size_t slen, const size_t elen)
+static int
+filter_lease(struct lease_t *p)
 {
-	int display = 1;
-	struct lease_t *p_cur;
-
-	printf("%-*s%-*s%-*s%-*s%-*s%-*s\n",
-		(int)cltlen + 2, "CLIENT",
-		(int)iplen  + 2, "IP ADDRESS",
-		(int)maclen + 2, "MAC ADDRESS",
-                (int)slen   + 2, "LEASE START",
-		(int)elen   + 2, "LEASE END",
-		7           + 2, "EXPIRED");
+	if (mflag && match_partial_field(&p->raw_macaddr, mval) != 0)
+		return 0;
+	if (cflag && !match_client(p))
+		return 0;
+	if (iflag && match_partial_field(&p->raw_ipaddr, ival) != 0)
+		return 0;
+	if (aflag && has_lease_expired(lease_end(p)))
+		return 0;
+	if (xflag && !has_lease_expired(lease_end(p)))
+		return 0;
+	return 1;
+}
 
-	if (TAILQ_EMPTY(&head))
-		return;
 
-	TAILQ_FOREACH(p_cur, &head, entities) {
-		/* Depending on options, find out whether to show the current lease entry */
-		if (mflag)
-			display = (match_partial_string(p_cur->macaddr, mval) == 0) ? 1 : 0;
-		if (cflag)
-			display = (match_partial_string(p_cur->client, cval) == 0) ? 1 : 0;
-		if (iflag)
-			display = (match_partial_string(p_cur->ipaddr, ival) == 0) ? 1 : 0;
-		if (aflag)
-			display = has_lease_expired(p_cur->end) ? 0 : 1;
-		if (xflag)
-			display = has_lease_expired(p_cur->end) ? 1 : 0;
+/*
+ * Widen the output columns to fit the given lease.  Only the columns
+ * being shown are looked at, so nothing else gets decoded.
+ */
+static void
+widen(struct lease_t *p)
+{
+	struct column *col;
+	size_t i, len;
 
-		if (display == 1)
-			printf("%-*s%-*s%-*s%-*s%-*s%-*s\n",
-				(int)cltlen + 2, p_cur->client,
-				(int)iplen  + 2, p_cur->ipaddr,
-				(int)maclen + 2, p_cur->macaddr,
-				(int)slen   + 2, time_to_string(&p_cur->start),
-				(int)elen   + 2, time_to_string(&p_cur->end),
-				7           + 2, has_lease_expired(p_cur->end) ? "Yes" : "No");
+	for (i = 0; i < ncolumns; i++) {
+		col = layout[i];
+		if (col->measure != NULL && (len = col->measure(p)) > col->width)
+			col->width = len;
 	}
 }
 
 
 /*
- * Initialize and perform parsing and handle parsing of tokens
+ * Compile a comma separated list of column names into the layout used
+ * for every row
  */
 static void
-parse_lease_file(void)
+parse_columns(const char *arg)
 {
-	int tmp;
-	int count;
-	int hastoken;
-	size_t len_client;
-	size_t len_ipaddr;
-	size_t len_macaddr;
-	size_t len_start;
-	size_t len_end;
-
-	cpos = 0;
-	line = 0;
-	token = 0;
-
-	/* For padding in output_leases */
-	len_client = 0;
-	len_ipaddr = 0;
-	len_macaddr = 0;
-	len_start = 0;
-	len_end = 0;
-
-	/* No. of valid tokens encountered */
-	count = 0;
-
-	/* Do we have a valid token at the moment? */
-	hastoken = 0;
+	char *list, *name, *next;
+	size_t i;
 
-	/* Are we inside a lease block? */
-	inblock = 0;
+	if ((list = strdup(arg)) == NULL)
+		error("%s: out of memory\n", prog);
 
-	do {
-		token = get_token(&count, &hastoken);
-
-		/* We have just finished a block and found the closing curly brace */
-		if (inblock == 0 && buffer[0] == CHAR_CURLY_BRACE_END)
-			continue;
-
-		if (count == 1 && hastoken == 1 && token != TOK_LEASE)
-			error("%s: syntax error: expected a 'lease' section, got '%s'\n",
-				prog, token, buffer);
-
-		if (hastoken == 1 && token != TOK_LEASE && inblock == 0)
-			error("%s: parse error: found token '%s' outside lease boundaries\n", prog, buffer);
-
-		switch (token) {
-			/* Get assigned IP address, ensure syntax */
-			case TOK_LEASE:
-				if (inblock == 1)
-					error("%s: parse error: lease section began inside existing lease section\n", prog);
-				inblock = 1;
-				parse_ip_address();
-				if (strlen(buffer) > len_ipaddr)
-					len_ipaddr = strlen(buffer);
-				seek_char(CHAR_CURLY_BRACE_START);
-				asprintf(&lbuf->ipaddr, "%s", buffer);
-				if (strlen(buffer) > len_ipaddr)
-					len_ipaddr = strlen(buffer);
-				break;
-
-			/* Read and parse date string */
-			case TOK_STARTS:
-				check_block_scope();
-				read_string_to_semicolon();
-				lbuf->start = parse_date_string();
-				if (strlen(time_to_string(&lbuf->start)) > len_start)
-					len_start = strlen(time_to_string(&lbuf->start));
-				break;
-
-			/* Read and parse date string */
-			case TOK_ENDS:
-				check_block_scope();
-				read_string_to_semicolon();
-				lbuf->end = parse_date_string();
-				if (strlen(time_to_string(&lbuf->end)) > len_end)
-					len_end = strlen(time_to_string(&lbuf->end));
+	ncolumns = 0;
+	for (next = list; (name = strsep(&next, ",")) != NULL; ) {
+		for (i = 0; i < COL_MAX; i++) {
+			if (strcasecmp(name, columns[i].name) == 0)
 				break;
-
-			/* Read and parse mac address string */
-			case TOK_HARDWARE:
-				check_block_scope();
-				tmp = get_token(&count, &hastoken);
-				if (tmp != TOK_ETHERNET)
-					break;
-
-				parse_ethernet_address();
-				asprintf(&lbuf->macaddr, "%s", buffer);
-				if (strlen(buffer) > len_macaddr)
-					len_macaddr = strlen(buffer);
-				break;
-			/* Read and format client name string */
-			case TOK_CLIENT_HOSTNAME:
-				check_block_scope();
-				parse_client_hostname();
-				asprintf(&lbuf->client, "%s", buffer);
-				if (strlen(buffer) > len_client)
-					len_client = strlen(buffer);
-				break;
-
-			/* Check if the lease is abandoned */
-			case TOK_ABANDONED:
-				tmp = peek_char();
-// not working tmp is always \x10 insted of ;
-//				if (tmp != CHAR_SEMICOLON)
-//					error("%s: parse error: expected ';' after '%s'\n", prog, buffer);
-				lbuf->abandoned = 1;
-			default:
-				;
 		}
-	} while (!feof(fp));
-
-	fclose(fp);
+		if (i == COL_MAX)
+			error("%s: unknown column '%s'\n", prog, name);
+		if (columns[i].shown)
+			error("%s: column '%s' given twice\n", prog, name);
+		columns[i].shown = 1;
+		layout[ncolumns++] = &columns[i];
+	}
 
-	if (dflag)
-		remove_duplicates();
-	output_leases(len_client, len_ipaddr, len_macaddr, len_start, len_end);
+	free(list);
 }
 
 
+/*
+ * The rows are built in a buffer of our own and written out in large
+ * blocks, bypassing stdio formatting
+ */
 static void
-check_block_scope(void)
+out_flush(void)
 {
-	if (!inblock)
-		error("%s: parse error: element '%s' found outside block scope\n", prog, buffer);
+	if (outlen > 0 && fwrite(outbuf, outlen, 1, stdout) != 1)
+		error("%s: failed to write output: %s\n", prog, strerror(errno));
+	outlen = 0;
 }
 
 
 /*
- * Jump to the desired character in the same line.
- * The character must be found or the parsing run will fail
+ * Append s, or nothing if it is NULL, padded to width plus the column
+ * gap.  Fields are much shorter than the buffer as the parser limits
+ * them to a couple of kilobytes.
  */
 static void
-seek_char(const unsigned char chr)
+out_pad(const char *s, size_t width)
 {
-	int c, located;
-	located = 0;
-	do {
-		c = get_char();
-		if (c == chr) {
-			located = 1;
-			return;
-		}
+	size_t len;
 
-		if (c == '\n' && located == 0)
-			error("%s: parse error: missing '%c' in line %d\n", prog, chr, line);
-	} while(1);
+	len = (s != NULL) ? strlen(s) : 0;
+	if (outlen + MAX(len, width + 2) > sizeof(outbuf))
+		out_flush();
+
+	if (len > 0)
+		memcpy(outbuf + outlen, s, len);
+	outlen += len;
+	for (; len < width + 2; len++)
+		outbuf[outlen++] = ' ';
 }
 
 
-/*
- * Take a look at the next character in the byte stream without
- * advancing the pointer
- */
-static int
-peek_char(void)
+static void
+out_char(char c)
 {
-	int c, d;
-
-	c = getc(fp);
-	if (feof(fp))
-		return -1;
-
-	d = ungetc(c, fp);
-	if (feof(fp))
-		error("%s: can't peek ahead\n", prog);
-
-	return d;
+	if (outlen == sizeof(outbuf))
+		out_flush();
+	outbuf[outlen++] = c;
 }
 
 
 /*
- * Get the next byte from the file stream.  Includes some
- * minor parser/list logic.
+ * Column measures and emitters.  The emitters write a single field of
+ * a row straight into the output buffer.
  */
-static int
-get_char(void)
+static size_t
+measure_client(struct lease_t *p)
 {
-	int c;
+	const char *client;
 
+	return ((client = lease_client(p)) != NULL) ? strlen(client) : 0;
+}
 
-	c = getc(fp);
 
-	if (feof(fp))
-		return -1;
+static size_t
+measure_ipaddr(struct lease_t *p)
+{
+	return (lease_ipaddr(p) != NULL) ? strlen(p->ipaddr) : 0;
+}
 
-	if (ferror(fp) != 0)
-		error("%s: failed to read from lease file\n", prog);
 
-	/*
-		The inblock is not set by the matching '{' but rather as soon as the
-		"lease" token is encountered. There is still syntax checking for the
-		'{', though.
-	*/
-	if (c == '}' && inblock != 1)
-		error("%s: parse error: unbalanced bracket at line %d, pos %d\n", prog, line, cpos);
+static size_t
+measure_macaddr(struct lease_t *p)
+{
+	return (lease_macaddr(p) != NULL) ? strlen(p->macaddr) : 0;
+}
 
-	if (c == '}') {
-		inblock = 0;
-		TAILQ_INSERT_TAIL(&head, lbuf, entities);
-	}
 
-	if (c == '\n') {
-		line++;
-		cpos = 0;
-	}
-	cpos++;
+/* asctime() dates have a fixed width, there is no need to format them */
+static size_t
+measure_time(struct lease_t *p __unused)
+{
+	return TIMESTR_WIDTH;
+}
 
-	return c;
 
+static size_t
+measure_state(struct lease_t *p)
+{
+	return (lease_state(p) != NULL) ? strlen(p->state) : 0;
 }
 
 
-/*
- * Jump forward to the next occurrence of ';'
- */
 static void
-read_string_to_semicolon(void)
+emit_client(struct lease_t *p, size_t width)
 {
-	int c, i;
-	memset(buffer, 0, sizeof(buffer));
-
-	i = 0;
-	do {
-		c = get_char();
-		if (c == -1)
-			error("%s: parse error: unexpected EOF at line %d, pos %d\n", prog, line, cpos);
+	out_pad(lease_client(p), width);
+}
 
-		if (c == '\n')
-			error("%s: parse error: unexpected newline at line %d, pos %d, expected ';'\n", prog, line, cpos);
 
-		if (c == ';')
-			break;
+static void
+emit_ipaddr(struct lease_t *p, size_t width)
+{
+	out_pad(lease_ipaddr(p), width);
+}
 
-		buffer[i++] = c;
 
-	} while (1);
+static void
+emit_macaddr(struct lease_t *p, size_t width)
+{
+	out_pad(lease_macaddr(p), width);
 }
 
 
 static void
-parse_ip_address(void)
+emit_start(struct lease_t *p, size_t width)
 {
-	int c, i;
-	memset(buffer, 0, sizeof(buffer));
-
-	i = 0;
-	do {
-		c = get_char();
-		if (c == -1)
-			error("%s: parse error: unexpected EOF at line %d, pos %d\n", prog, line, cpos);
+	char tbuf[TIMESTR_LEN];
+	time_t t;
 
-		if (c == '\n')
-			error("%s: parse error: unexpected newline at line %d, pos %d\n", prog, line, cpos);
+	t = lease_start(p);
+	out_pad(time_to_string(&t, tbuf), width);
+}
 
-		if (isspace(c) || c == '"' || c == ';')
-			break;
 
-		if (isascii(c) || isdigit(c))
-			buffer[i++] = c;
-	} while(1);
+static void
+emit_end(struct lease_t *p, size_t width)
+{
+	char tbuf[TIMESTR_LEN];
+	time_t t;
 
+	t = lease_end(p);
+	out_pad(time_to_string(&t, tbuf), width);
 }
 
 
 static void
-parse_ethernet_address(void)
+emit_expired(struct lease_t *p, size_t width)
 {
-	int c, i;
-	memset(buffer, 0, sizeof(buffer));
-
-	i = 0;
-	do {
-		c = get_char();
+	out_pad(has_lease_expired(lease_end(p)) ? "Yes" : "No", width);
+}
 
-		if (c == -1)
-			error("%s: parse error: unexpected EOF at line %d, pos %d\n", prog, line, cpos);
 
-		if (c == '\n')
-			error("%s: parse error: unexpected newline at line %d, pos %d\n", prog, line, cpos);
+static void
+emit_state(struct lease_t *p, size_t width)
+{
+	out_pad(lease_state(p), width);
+}
 
-		if (isspace(c) || c == '"' || c == ';')
-			break;
 
-		if (isascii(c) || isdigit(c))
-			buffer[i++] = c;
-	} while(1);
+static void
+emit_abandoned(struct lease_t *p, size_t width)
+{
+	out_pad(p->abandoned ? "Yes" : "No", width);
 }
 
 
 /*
- * Parse the client hostname, stripping the surrounding quotes
- * in the process
+ * Start a row with a label column, as used by --diff and --conflicts
  */
 static void
-parse_client_hostname(void)
+output_label(const char *label)
 {
-	int c, i;
-	memset(buffer, 0, sizeof(buffer));
+	out_pad(label, LABEL_WIDTH);
+}
 
-	i = 0;
-	do {
-		c = get_char();
 
-		if (c == -1)
-			error("%s: parse error: unexpected EOF at line %d, pos %d\n", prog, line, cpos);
+static void
+output_header(void)
+{
+	size_t i;
 
-		if (c == '\n')
-			error("%s: parse error: unexpected newline at line %d, pos %d\n", prog, line, cpos);
+	for (i = 0; i < ncolumns; i++)
+		out_pad(layout[i]->title, layout[i]->width);
+	out_char('\n');
+}
 
-		if (c == '"')
-			continue;
 
-		if (isspace(c) || c == ';')
-			break;
+static void
+output_lease(struct lease_t *p)
+{
+	size_t i;
 
-		if (isascii(c) || isdigit(c))
-			buffer[i++] = c;
-	} while(1);
+	for (i = 0; i < ncolumns; i++)
+		layout[i]->emit(p, layout[i]->width);
+	out_char('\n');
 }
 
 
 /*
- * Parse the date string and immediately get rid of the prepended
- * weekday which we don't need
+ * Format, filter and show output
  */
-static time_t
-parse_date_string(void)
+static void
+output_leases(void)
 {
-	char datebuf[64];
-	if (strlen(buffer) < 3)
-		error("%s: weird buffer\n", prog);
+	struct lease_t *p_cur, **rows;
+	size_t i, n;
+
+	if ((rows = calloc(nleases + 1, sizeof(*rows))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	n = 0;
+	TAILQ_FOREACH(p_cur, &head, entities) {
+		if (filter_lease(p_cur)) {
+			widen(p_cur);
+			rows[n++] = p_cur;
+		}
+	}
 
-	/* For a specific byte sequence, wipe the 2 first chars from the buffer */
-	if (isdigit(buffer[0]) && isspace(buffer[1]))
-		strncpy(datebuf, buffer + 2, strlen(buffer) - 2);
+	output_header();
+	for (i = 0; i < n; i++)
+		output_lease(rows[i]);
 
-	return string_to_time(datebuf);
+	free(rows);
 }
 
 
 /*
- * Look for the next token by scanning bytes until we reach a boundary
- * and then check if the string is a valid (supported) token
+ * Orders leases by the key of the index being built, then by start time
  */
 static int
-get_token(int *count, int *found)
+index_cmp(const void *p1, const void *p2)
 {
-	int i, c, kwl;
+	struct lease_t *l1 = *(struct lease_t * const *)p1;
+	struct lease_t *l2 = *(struct lease_t * const *)p2;
+	int r;
+
+	if ((r = strcasecmp(idxkey(l1), idxkey(l2))) != 0)
+		return r;
+	if ((r = compare_time(lease_start(l1), lease_start(l2))) != 0)
+		return r;
+	return (l1->seq < l2->seq) ? -1 : (l1->seq > l2->seq);
+}
 
-	i = kwl = 0;
 
-	memset(buffer, 0, sizeof(buffer));
+/*
+ * Sort the parsed leases into an interval index on the given key.
+ * Leases without a value for the key are left out.  dhcpd appends a new
+ * record for a lease whenever it changes, e.g. one with an earlier end
+ * when the lease is released, so of the records with the same key and
+ * start only the last one in the lease file is kept.  The index is only
+ * built once; later calls return immediately.
+ */
+static void
+build_index(struct lease_index *idx, const char *(*key)(struct lease_t *), int (*tokey)(const char *, uint64_t *))
+{
+	struct lease_t *p_cur;
+	size_t i, n;
 
-	/* Haven't found a token yet */
-	*found = 0;
-	do {
-		c = get_char();
-		if (c == -1)
-			return 0;
+	if (idx->ent != NULL)
+		return;
 
-		if (c == -1) {
-			printf("eof reached\n");
-			break;
-		}
+	n = 0;
+	TAILQ_FOREACH(p_cur, &head, entities)
+		n++;
 
-		if (c == '\t' || c == '\n' || c == ';' || isspace(c))
-			break;
+	idx->key = key;
+	idx->tokey = tokey;
+	idx->nent = 0;
+	idx->ngroups = 0;
+	if ((idx->ent = calloc(n + 1, sizeof(*idx->ent))) == NULL ||
+	    (idx->maxend = calloc(n + 1, sizeof(*idx->maxend))) == NULL ||
+	    (idx->group = calloc(n + 1, sizeof(*idx->group))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	TAILQ_FOREACH(p_cur, &head, entities) {
+		if (key(p_cur) != NULL)
+			idx->ent[idx->nent++] = p_cur;
+	}
 
-		buffer[i++] = c;
+	idxkey = key;
+	qsort(idx->ent, idx->nent, sizeof(*idx->ent), index_cmp);
 
-		if (c == '#') {
-			printf("comment char found! ");
-			do {
-				c = get_char();
-			}
-			while (c != '\n');
-			printf ("eol!\n");
+	/* Records superseded by a later one sort right before it */
+	for (i = n = 0; i < idx->nent; i++) {
+		if (i + 1 < idx->nent && strcasecmp(key(idx->ent[i]), key(idx->ent[i + 1])) == 0 &&
+		    compare_time(lease_start(idx->ent[i]), lease_start(idx->ent[i + 1])) == 0)
 			continue;
-		}
+		idx->ent[n++] = idx->ent[i];
+	}
+	idx->nent = n;
+
+	for (i = 0; i < idx->nent; i++) {
+		idx->maxend[i] = lease_end(idx->ent[i]);
+		if (i == 0 || strcasecmp(key(idx->ent[i - 1]), key(idx->ent[i])) != 0)
+			idx->group[idx->ngroups++] = i;
+		else if (compare_time(idx->maxend[i - 1], idx->maxend[i]) > 0)
+			idx->maxend[i] = idx->maxend[i - 1];
+	}
+	idx->group[idx->ngroups] = idx->nent;
+}
+
+
+/*
+ * Collect the leases of key group g that were held at some point in
+ * [t1, t2], i.e. started no later than t2 and ended after t1, oldest
+ * first.  Returns their number.
+ */
+static size_t
+query_group(const struct lease_index *idx, size_t g, time_t t1, time_t t2, struct lease_t **out)
+{
+	size_t lo, hi, mid, i, n;
+	struct lease_t *tmp;
+
+	/* First lease in the group starting after t2 */
+	lo = idx->group[g];
+	hi = idx->group[g + 1];
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (compare_time(lease_start(idx->ent[mid]), t2) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* Walk back for as long as an earlier lease may still overlap */
+	n = 0;
+	for (i = lo; i > idx->group[g] && compare_time(idx->maxend[i - 1], t1) > 0; i--) {
+		if (compare_time(lease_end(idx->ent[i - 1]), t1) > 0)
+			out[n++] = idx->ent[i - 1];
+	}
 
+	/* Restore chronological order */
+	for (lo = 0, hi = n; lo + 1 < hi; lo++, hi--) {
+		tmp = out[lo];
+		out[lo] = out[hi - 1];
+		out[hi - 1] = tmp;
 	}
-	while (1);
 
-	/* Check if we have a token */
-	kwl = lookup(buffer);
-	if (kwl <= TOK_INVALID_TOKEN)
-		return TOK_INVALID_TOKEN;
+	return n;
+}
+
 
-	/* For lease tokens, allocate a new structure for the current lease */
-	if (kwl == TOK_LEASE)
-		lbuf = calloc(1, sizeof(struct lease_t));
+/*
+ * Collect every lease in the index that was held at some point in
+ * [t1, t2].  A complete key given as search is looked up by binary
+ * search; anything else is matched partially against every key, once
+ * per key rather than once per lease.  Results are stored in out in key
+ * order, oldest lease first, and their number is returned.
+ */
+static size_t
+query_index(const struct lease_index *idx, const char *search, time_t t1, time_t t2, struct lease_t **out)
+{
+	size_t g, lo, hi, mid, n;
+	uint64_t k;
+	int r;
+
+	if (search != NULL && idx->tokey(search, &k) == 0) {
+		lo = 0;
+		hi = idx->ngroups;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			r = strcasecmp(idx->key(idx->ent[idx->group[mid]]), search);
+			if (r == 0)
+				return query_group(idx, mid, t1, t2, out);
+			if (r < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return 0;
+	}
 
-	*count += 1;
-	*found = 1;
+	n = 0;
+	for (g = 0; g < idx->ngroups; g++) {
+		if (search != NULL && match_partial_string(idx->key(idx->ent[idx->group[g]]), search) != 0)
+			continue;
+		n += query_group(idx, g, t1, t2, out + n);
+	}
 
-	return kwl;
+	return n;
 }
 
 
+/*
+ * Show the leases held at any time between t1 and t2.  Queries for a
+ * MAC address go through the MAC index, everything else through the
+ * IP index, so the output is grouped by the searched-for key.
+ */
 static void
-open_lease_file(const char *filename)
+output_query(time_t t1, time_t t2)
 {
-	if ((fp = fopen(filename, "r")) == NULL)
-		error("%s: couldn't open lease file %s\n", prog, filename);
-}
+	struct lease_index *idx;
+	struct lease_t **res;
+	const char *search;
+	size_t i, j, n;
+
+	if (mflag && !iflag) {
+		idx = &macidx;
+		build_index(idx, lease_macaddr, mac_to_key);
+		search = mval;
+	} else {
+		idx = &ipidx;
+		build_index(idx, lease_ipaddr, ip_to_key);
+		search = iflag ? ival : NULL;
+	}
+
+	if ((res = calloc(idx->nent + 1, sizeof(*res))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	n = query_index(idx, search, t1, t2, res);
+
+	/* Apply the remaining filters in place */
+	for (i = j = 0; i < n; i++) {
+		if (filter_lease(res[i])) {
+			widen(res[i]);
+			res[j++] = res[i];
+		}
+	}
 
+	output_header();
+	for (i = 0; i < j; i++)
+		output_lease(res[i]);
+
+	free(res);
+}
 
 
+/*
+ * Converts a dotted IPv4 address to a sortable integer key.
+ * Returns 0 on success, otherwise -1.
+ */
 static int
-keyword_cmp(const void *p1, const void *p2)
+ip_to_key(const char *ipaddr, uint64_t *key)
 {
-	return (strcasecmp(p1, ((const struct keywords *)p2)->name));
+	struct in_addr in;
+
+	if (ipaddr == NULL || inet_pton(AF_INET, ipaddr, &in) != 1)
+		return -1;
+
+	*key = ntohl(in.s_addr);
+	return 0;
 }
 
 
+/*
+ * Converts a colon separated MAC address to a sortable integer key.
+ * Returns 0 on success, otherwise -1.
+ */
 static int
-lookup(char *value)
+mac_to_key(const char *macaddr, uint64_t *key)
 {
-	const struct keywords *p;
+	unsigned int o[6];
+	int i, n;
 
-	p = bsearch(value, keywords, sizeof(keywords) / sizeof(keywords[0]),
-		sizeof(keywords[0]), keyword_cmp);
+	if (macaddr == NULL)
+		return -1;
+
+	n = -1;
+	if (sscanf(macaddr, "%2x:%2x:%2x:%2x:%2x:%2x%n",
+	    &o[0], &o[1], &o[2], &o[3], &o[4], &o[5], &n) != 6 ||
+	    n < 0 || macaddr[n] != '\0')
+		return -1;
 
-	if (p)
-		return (p->value);
-	return TOK_INVALID_TOKEN;
+	*key = 0;
+	for (i = 0; i < 6; i++)
+		*key = (*key << 8) | o[i];
+	return 0;
 }
 
 
-int
-main(int argc, char **argv)
+/*
+ * Returns 1 if the lease was bound at the reference time, otherwise 0
+ */
+static int
+is_bound(struct lease_t *p, time_t tref)
 {
-	int g;
-        char *tmp;
-	char *fval;
+	return (!p->abandoned && compare_time(lease_end(p), tref) > 0);
+}
 
-	TAILQ_INIT(&head);
 
-        if ((tmp = strrchr(argv[0], '/')) != NULL)
-                prog = tmp + 1;
-	else
+static int
+snapent_cmp(const void *p1, const void *p2)
+{
+	const struct snapent *e1 = p1;
+	const struct snapent *e2 = p2;
+
+	if (e1->key != e2->key)
+		return (e1->key < e2->key) ? -1 : 1;
+	if (e1->lease->seq != e2->lease->seq)
+		return (e1->lease->seq < e2->lease->seq) ? -1 : 1;
+	return 0;
+}
+
+
+/*
+ * Reduce a list of leases to the latest lease per key, sorted by the
+ * binary key.  As dhcpd appends to its lease file, the last lease seen
+ * for a key is its current state.  With cutoff set, only leases which
+ * started no later than tcut are considered.
+ */
+static void
+build_snapshot(struct snapshot *snap, struct thead *list, int (*tokey)(const char *, uint64_t *), const char *(*key)(struct lease_t *), int cutoff, time_t tcut)
+{
+	struct lease_t *p_cur;
+	size_t i, n;
+	uint64_t k;
+
+	n = 0;
+	TAILQ_FOREACH(p_cur, list, entities)
+		n++;
+
+	if ((snap->ent = calloc(n + 1, sizeof(*snap->ent))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	snap->nent = 0;
+	TAILQ_FOREACH(p_cur, list, entities) {
+		if (cutoff && compare_time(lease_start(p_cur), tcut) > 0)
+			continue;
+		if (tokey(key(p_cur), &k) != 0)
+			continue;
+		snap->ent[snap->nent].key = k;
+		snap->ent[snap->nent].lease = p_cur;
+		snap->nent++;
+	}
+
+	qsort(snap->ent, snap->nent, sizeof(*snap->ent), snapent_cmp);
+
+	/* Keep only the last entry of each run of equal keys */
+	n = 0;
+	for (i = 0; i < snap->nent; i++) {
+		if (i + 1 < snap->nent && snap->ent[i + 1].key == snap->ent[i].key)
+			continue;
+		snap->ent[n++] = snap->ent[i];
+	}
+	snap->nent = n;
+}
+
+
+static void
+add_change(int what, struct lease_t *old, struct lease_t *new)
+{
+	if (nchanges == changecap) {
+		changecap = changecap ? changecap * 2 : 64;
+		if ((changes = realloc(changes, changecap * sizeof(*changes))) == NULL)
+			error("%s: out of memory\n", prog);
+	}
+
+	changes[nchanges].what = what;
+	changes[nchanges].old = old;
+	changes[nchanges].new = new;
+	nchanges++;
+}
+
+
+/*
+ * Merge-join two snapshots on their key and record what changed.  told
+ * and tnew are the points in time each snapshot describes.  With bymac
+ * unset the snapshots are keyed on IP address, otherwise on MAC address.
+ */
+static void
+diff_snapshots(const struct snapshot *old, const struct snapshot *new, time_t told, time_t tnew, int bymac)
+{
+	struct lease_t *o, *n;
+	const char *oc, *nc;
+	size_t i, j;
+	int ob, nb;
+
+	i = j = 0;
+	while (i < old->nent || j < new->nent) {
+		o = n = NULL;
+		if (j >= new->nent || (i < old->nent && old->ent[i].key < new->ent[j].key))
+			o = old->ent[i++].lease;
+		else if (i >= old->nent || new->ent[j].key < old->ent[i].key)
+			n = new->ent[j++].lease;
+		else {
+			o = old->ent[i++].lease;
+			n = new->ent[j++].lease;
+		}
+
+		ob = (o != NULL && is_bound(o, told));
+		nb = (n != NULL && is_bound(n, tnew));
+
+		if (bymac) {
+			if (ob && nb && strcmp(lease_ipaddr(o), lease_ipaddr(n)) != 0)
+				add_change(CHG_MOVED, o, n);
+			continue;
+		}
+
+		if (!ob && nb)
+			add_change(CHG_NEW, o, n);
+		else if (ob && !nb)
+			/* Whatever is in the new file never held this binding */
+			add_change(CHG_RELEASED, o, NULL);
+		else if (ob && nb) {
+			if (lease_macaddr(o) == NULL || lease_macaddr(n) == NULL ||
+			    strcasecmp(o->macaddr, n->macaddr) != 0)
+				add_change(CHG_REBOUND, o, n);
+			else if (o->client_id != n->client_id) {
+				/* Different raw hostnames may still decode alike */
+				oc = lease_client(o);
+				nc = lease_client(n);
+				if (oc == NULL || nc == NULL || strcmp(oc, nc) != 0)
+					add_change(CHG_RENAMED, o, n);
+			}
+		}
+	}
+}
+
+
+/*
+ * Show what changed between two sets of leases, grouped by the kind of
+ * change.  Each change shows the current lease and, where a binding was
+ * altered rather than added or removed, the lease it replaced.  With
+ * cutoff set, the old side only holds leases started by told.
+ */
+static void
+output_diff(struct thead *oldlist, time_t told, struct thead *newlist, time_t tnew, int cutoff)
+{
+	struct snapshot oldip, newip, oldmac, newmac;
+	struct change *c;
+	size_t i, n;
+	int what;
+
+	build_snapshot(&oldip, oldlist, ip_to_key, lease_ipaddr, cutoff, told);
+	build_snapshot(&newip, newlist, ip_to_key, lease_ipaddr, 0, tnew);
+	build_snapshot(&oldmac, oldlist, mac_to_key, lease_macaddr, cutoff, told);
+	build_snapshot(&newmac, newlist, mac_to_key, lease_macaddr, 0, tnew);
+
+	diff_snapshots(&oldip, &newip, told, tnew, 0);
+	diff_snapshots(&oldmac, &newmac, told, tnew, 1);
+
+	/* Drop the changes not matching the filters and size the columns */
+	for (i = n = 0; i < nchanges; i++) {
+		c = &changes[i];
+		if (!((c->new != NULL && filter_lease(c->new)) ||
+		    (c->old != NULL && filter_lease(c->old))))
+			continue;
+		if (c->new != NULL)
+			widen(c->new);
+		if (c->old != NULL)
+			widen(c->old);
+		changes[n++] = *c;
+	}
+	nchanges = n;
+
+	output_label("CHANGE");
+	output_header();
+
+	for (what = 0; what < CHG_MAX; what++) {
+		for (i = 0; i < nchanges; i++) {
+			c = &changes[i];
+			if (c->what != what)
+				continue;
+
+			output_label(change_names[what]);
+			output_lease(c->new != NULL ? c->new : c->old);
+
+			if (what == CHG_REBOUND || what == CHG_MOVED || what == CHG_RENAMED) {
+				output_label("  was");
+				output_lease(c->old);
+			}
+		}
+	}
+
+	free(oldip.ent);
+	free(newip.ent);
+	free(oldmac.ent);
+	free(newmac.ent);
+}
+
+
+static size_t
+hash_key(uint64_t key, size_t mask)
+{
+	return (size_t)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+
+/*
+ * Returns 1 if the lease is in the active binding state.  Lease files
+ * of older dhcpd versions carry no binding state; their leases are
+ * taken to be active.
+ */
+static int
+is_active(struct lease_t *p)
+{
+	return (lease_state(p) == NULL || strcasecmp(p->state, "active") == 0);
+}
+
+
+/*
+ * Order conflict entries by start time, then by IP address, and records
+ * of the same lease by their position in the lease file
+ */
+static int
+cflent_cmp(const void *p1, const void *p2)
+{
+	const struct cflent *e1 = p1;
+	const struct cflent *e2 = p2;
+
+	if (e1->start != e2->start)
+		return (e1->start < e2->start) ? -1 : 1;
+	if (e1->ip != e2->ip)
+		return (e1->ip < e2->ip) ? -1 : 1;
+	if (e1->lease->seq != e2->lease->seq)
+		return (e1->lease->seq < e2->lease->seq) ? -1 : 1;
+	return 0;
+}
+
+
+/*
+ * Split the entries into groups sharing the same IP address or, with
+ * bymac set, the same MAC address.  A hash table maps every key to its
+ * group in one pass, and a stable counting sort then lays the groups
+ * out one after another in part, keeping the order of the entries
+ * within each group.  Group g occupies part[start[g]] up to
+ * part[start[g + 1]].  Returns the number of groups.
+ */
+static size_t
+partition_conflicts(struct cflent *ent, size_t n, int bymac, struct cflent *part, size_t **startp)
+{
+	uint64_t *keys, k;
+	size_t *gid, *start, *next;
+	size_t i, h, mask, ngroups;
+
+	for (mask = 1; mask < 2 * n; mask <<= 1)
+		;
+	mask--;
+
+	if ((keys = calloc(mask + 1, sizeof(*keys))) == NULL ||
+	    (gid = calloc(mask + 1, sizeof(*gid))) == NULL ||
+	    (start = calloc(n + 2, sizeof(*start))) == NULL ||
+	    (next = calloc(n + 1, sizeof(*next))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	/* gid holds the group number plus one, so zero marks a free slot */
+	ngroups = 0;
+	for (i = 0; i < n; i++) {
+		k = bymac ? ent[i].mac : ent[i].ip;
+		for (h = hash_key(k, mask); gid[h] != 0 && keys[h] != k; h = (h + 1) & mask)
+			;
+		if (gid[h] == 0) {
+			keys[h] = k;
+			gid[h] = ++ngroups;
+		}
+		ent[i].group = gid[h] - 1;
+		start[ent[i].group + 1]++;
+	}
+
+	for (i = 0; i < ngroups; i++)
+		start[i + 1] += start[i];
+	memcpy(next, start, ngroups * sizeof(*next));
+
+	for (i = 0; i < n; i++)
+		part[next[ent[i].group]++] = ent[i];
+
+	free(keys);
+	free(gid);
+	free(next);
+
+	*startp = start;
+	return ngroups;
+}
+
+
+static void
+add_conflict(int what, struct lease_t *lease, struct lease_t *with)
+{
+	if (nconflicts == conflictcap) {
+		conflictcap = conflictcap ? conflictcap * 2 : 64;
+		if ((conflicts = realloc(conflicts, conflictcap * sizeof(*conflicts))) == NULL)
+			error("%s: out of memory\n", prog);
+	}
+
+	conflicts[nconflicts].what = what;
+	conflicts[nconflicts].lease = lease;
+	conflicts[nconflicts].with = with;
+	nconflicts++;
+}
+
+
+/*
+ * Find the leases of each group overlapping an earlier lease held by a
+ * different MAC address or, with bymac set, on a different IP address.
+ * The groups must be in start order.  A sweep keeps track of the lease
+ * reaching furthest and of the one reaching furthest among those with a
+ * different key than it; one of the two is the latest ending earlier
+ * lease with a key other than that of the current lease.
+ */
+static void
+find_conflicts(struct cflent *ent, const size_t *start, size_t ngroups, int bymac)
+{
+	struct cflent *far, *far2, *with;
+	uint64_t k, kfar;
+	size_t g, i;
+
+	for (g = 0; g < ngroups; g++) {
+		far = far2 = NULL;
+		for (i = start[g]; i < start[g + 1]; i++) {
+			k = bymac ? ent[i].ip : ent[i].mac;
+
+			if (far != NULL) {
+				kfar = bymac ? far->ip : far->mac;
+				with = (k != kfar) ? far : far2;
+				if (with != NULL && with->end > ent[i].start)
+					add_conflict(bymac ? CFL_MAC : CFL_IP, ent[i].lease, with->lease);
+			}
+
+			if (far == NULL || ent[i].end > far->end) {
+				if (far != NULL && k != (bymac ? far->ip : far->mac))
+					far2 = far;
+				far = &ent[i];
+			} else if (k != (bymac ? far->ip : far->mac) &&
+			    (far2 == NULL || ent[i].end > far2->end))
+				far2 = &ent[i];
+		}
+	}
+}
+
+
+/*
+ * Show leases overlapping in time with a lease for the same IP address
+ * but another MAC address, or for the same MAC address but another IP
+ * address.  Each is shown along with the lease it overlaps.
+ */
+static void
+output_conflicts(void)
+{
+	struct lease_t *p_cur;
+	struct cflent *ent, *part;
+	struct conflict *c;
+	size_t *start;
+	size_t i, m, n, ngroups;
+
+	if ((ent = calloc(nleases + 1, sizeof(*ent))) == NULL ||
+	    (part = calloc(nleases + 1, sizeof(*part))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	n = 0;
+	TAILQ_FOREACH(p_cur, &head, entities) {
+		if (ip_to_key(lease_ipaddr(p_cur), &ent[n].ip) != 0)
+			continue;
+		ent[n].start = lease_start(p_cur);
+		ent[n].end = lease_end(p_cur);
+		ent[n].lease = p_cur;
+		n++;
+	}
+
+	/*
+	 * Sort once by start time; partitioning keeps that order within
+	 * every group, whatever order the lease file is in
+	 */
+	qsort(ent, n, sizeof(*ent), cflent_cmp);
+
+	/*
+	 * dhcpd appends a new record for a lease whenever it changes, e.g.
+	 * one with an earlier end and a free binding state on release.  Of
+	 * the records with the same IP address and start only the last one
+	 * counts, and only if the address is still actively held.
+	 */
+	for (i = m = 0; i < n; i++) {
+		if (i + 1 < n && ent[i + 1].start == ent[i].start && ent[i + 1].ip == ent[i].ip)
+			continue;
+		p_cur = ent[i].lease;
+		if (p_cur->abandoned || !is_active(p_cur) || !filter_lease(p_cur) ||
+		    mac_to_key(lease_macaddr(p_cur), &ent[i].mac) != 0)
+			continue;
+		ent[m++] = ent[i];
+	}
+	n = m;
+
+	ngroups = partition_conflicts(ent, n, 0, part, &start);
+	find_conflicts(part, start, ngroups, 0);
+	free(start);
+
+	ngroups = partition_conflicts(ent, n, 1, part, &start);
+	find_conflicts(part, start, ngroups, 1);
+	free(start);
+	free(part);
+	free(ent);
+
+	for (i = 0; i < nconflicts; i++) {
+		widen(conflicts[i].lease);
+		widen(conflicts[i].with);
+	}
+
+	output_label("CONFLICT");
+	output_header();
+
+	for (i = 0; i < nconflicts; i++) {
+		c = &conflicts[i];
+		output_label(c->what == CFL_IP ? "ip" : "mac");
+		output_lease(c->lease);
+		output_label("  with");
+		output_lease(c->with);
+	}
+}
+
+
+/*
+ * FNV-1a hash of a raw field
+ */
+static uint32_t
+hash_field(const struct dhl_field *f)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261U;
+	for (i = 0; i < f->len; i++) {
+		h ^= (unsigned char)f->ptr[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+
+/*
+ * Intern a client hostname found in the lease file and return its ID,
+ * or NAME_NONE if the lease has none.  The same hostname shows up in
+ * lease after lease of a device's history, so it is kept once in the
+ * pool, pointing into the mapped lease file, and decoded at most once.
+ */
+static uint32_t
+intern_client(const struct dhl_field *f)
+{
+	struct name *nm;
+	uint32_t *slot, h;
+	size_t i, size;
+
+	if (f->ptr == NULL)
+		return NAME_NONE;
+
+	/* Keep the table at most half full, rehashing as it grows */
+	if (2 * names.n >= names.mask) {
+		size = (names.mask + 1) * 2;
+		if (size < NAME_MIN_SLOTS)
+			size = NAME_MIN_SLOTS;
+		if ((slot = calloc(size, sizeof(*slot))) == NULL)
+			error("%s: out of memory\n", prog);
+		for (i = 1; i <= names.n; i++) {
+			for (h = names.ent[i].hash & (size - 1); slot[h] != NAME_NONE; h = (h + 1) & (size - 1))
+				;
+			slot[h] = i;
+		}
+		free(names.slot);
+		names.slot = slot;
+		names.mask = size - 1;
+	}
+
+	h = hash_field(f);
+	for (i = h & names.mask; names.slot[i] != NAME_NONE; i = (i + 1) & names.mask) {
+		nm = &names.ent[names.slot[i]];
+		if (nm->hash == h && nm->raw.len == f->len && memcmp(nm->raw.ptr, f->ptr, f->len) == 0)
+			return names.slot[i];
+	}
+
+	if (names.n == UINT32_MAX - 1)
+		error("%s: too many client hostnames\n", prog);
+
+	/* Entry 0 stands for NAME_NONE and is never used */
+	if (names.n + 1 >= names.cap) {
+		names.cap = (names.cap == 0) ? NAME_MIN_SLOTS : names.cap * 2;
+		if ((names.ent = realloc(names.ent, names.cap * sizeof(*names.ent))) == NULL)
+			error("%s: out of memory\n", prog);
+	}
+
+	nm = &names.ent[++names.n];
+	nm->raw = *f;
+	nm->str = NULL;
+	nm->hash = h;
+	nm->match = -1;
+	names.slot[i] = names.n;
+
+	return names.n;
+}
+
+
+/*
+ * The -c filter.  For interned hostnames the match is worked out once
+ * per distinct hostname and remembered; leases not kept in memory,
+ * whose hostname is already decoded, are matched directly.
+ */
+static int
+match_client(struct lease_t *p)
+{
+	struct name *nm;
+
+	if (p->client_id == NAME_NONE || p->client_id == NAME_STREAM)
+		return match_partial_string(lease_client(p), cval) == 0;
+
+	nm = &names.ent[p->client_id];
+	if (nm->match == -1)
+		nm->match = (match_partial_field(&nm->raw, cval) == 0);
+	return nm->match;
+}
+
+
+/*
+ * Parser callback: keep the lease on the list passed in arg.  Only
+ * where its fields are in the lease file is recorded; they are decoded
+ * on first use by the lease_*() accessors.
+ */
+static int
+store_lease(const struct dhl_lease *l, void *arg)
+{
+	struct thead *list = arg;
+	struct lease_t *p;
+
+	if ((p = calloc(1, sizeof(struct lease_t))) == NULL)
+		return -1;
+
+	p->raw_start = l->raw_starts;
+	p->raw_end = l->raw_ends;
+	p->client_id = intern_client(&l->raw_hostname);
+	p->raw_ipaddr = l->raw_ipaddr;
+	p->raw_macaddr = l->raw_macaddr;
+	p->raw_state = l->raw_state;
+	p->abandoned = l->abandoned;
+	p->seq = nleases++;
+
+	TAILQ_INSERT_TAIL(list, p, entities);
+	return 0;
+}
+
+
+/*
+ * Map a lease file into memory.  Anything that can't be mapped, such as
+ * a pipe, is read into a buffer instead.  The mapping is never undone
+ * as the parsed leases point into it.  mtime is set to when the lease
+ * file was last written, or to now for anything but a regular file.
+ */
+static const char *
+map_lease_file(const char *filename, size_t *len, time_t *mtime)
+{
+	struct stat st;
+	char *buf, *tmp;
+	size_t size;
+	ssize_t n;
+	int fd;
+
+	if ((fd = open(filename, O_RDONLY)) == -1 || fstat(fd, &st) == -1)
+		error("%s: couldn't open lease file %s: %s\n", prog, filename, strerror(errno));
+
+	*mtime = S_ISREG(st.st_mode) ? st.st_mtime : time(NULL);
+
+	if (S_ISREG(st.st_mode) && st.st_size > 0) {
+		buf = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (buf != MAP_FAILED) {
+			(void)madvise(buf, (size_t)st.st_size, MADV_SEQUENTIAL);
+			close(fd);
+			*len = (size_t)st.st_size;
+			return buf;
+		}
+	}
+
+	buf = NULL;
+	size = *len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 65536;
+			if ((tmp = realloc(buf, size)) == NULL)
+				error("%s: out of memory\n", prog);
+			buf = tmp;
+		}
+		if ((n = read(fd, buf + *len, size - *len)) == -1)
+			error("%s: failed to read from lease file %s: %s\n", prog, filename, strerror(errno));
+		*len += (size_t)n;
+	} while (n > 0);
+
+	close(fd);
+	return buf;
+}
+
+
+/*
+ * Parse a lease file, appending its leases to the global list.  Returns
+ * the time the lease file was last written.
+ */
+static time_t
+load_lease_file(const char *filename)
+{
+	struct dhl_parser *parser;
+	const char *buf;
+	time_t mtime;
+	size_t len;
+
+	buf = map_lease_file(filename, &len, &mtime);
+
+	if ((parser = dhl_parser_new()) == NULL)
+		error("%s: out of memory\n", prog);
+	dhl_parser_setlazy(parser, 1);
+
+	switch (dhl_parse_buffer(parser, buf, len, store_lease, &head)) {
+		case DHL_OK:
+			break;
+		case DHL_EABORT:
+			error("%s: out of memory\n", prog);
+			break;
+		default:
+			error("%s: %s: %s\n", prog, filename, dhl_parser_error(parser));
+	}
+
+	dhl_parser_free(parser);
+	return mtime;
+}
+
+
+/*
+ * Single-producer/single-consumer ring buffer.  The producer only ever
+ * writes head and the consumer only ever writes tail, so no locking is
+ * needed; the release/acquire pairs make the slot contents visible
+ * before the index moving past them.
+ */
+static void
+ring_init(struct ring *r, size_t size)
+{
+	if ((r->slot = calloc(size, sizeof(*r->slot))) == NULL)
+		error("%s: out of memory\n", prog);
+	r->mask = size - 1;
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+}
+
+
+/*
+ * Back off while a ring is full or empty: spin briefly, then yield and
+ * finally sleep, so a stage waiting on slow I/O does not eat a CPU
+ */
+static void
+ring_wait(unsigned int *spins)
+{
+	struct timespec ts;
+
+	if (++*spins < 64)
+		return;
+	if (*spins < 1024) {
+		sched_yield();
+		return;
+	}
+	ts.tv_sec = 0;
+	ts.tv_nsec = 50000;
+	nanosleep(&ts, NULL);
+}
+
+
+static void
+ring_push(struct ring *r, void *item)
+{
+	unsigned int spins;
+	size_t h;
+
+	h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	for (spins = 0; h - atomic_load_explicit(&r->tail, memory_order_acquire) > r->mask; )
+		ring_wait(&spins);
+
+	r->slot[h & r->mask] = item;
+	atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+
+static void *
+ring_pop(struct ring *r)
+{
+	unsigned int spins;
+	void *item;
+	size_t t;
+
+	t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	for (spins = 0; t == atomic_load_explicit(&r->head, memory_order_acquire); )
+		ring_wait(&spins);
+
+	item = r->slot[t & r->mask];
+	atomic_store_explicit(&r->tail, t + 1, memory_order_release);
+	return item;
+}
+
+
+/*
+ * Reader stage: fill chunks with large reads while the parser works on
+ * the previous ones.  Every chunk is cut after its last closing curly
+ * brace, and the rest carried over to the next chunk, so that lease
+ * blocks never straddle two chunks.  An empty chunk marks the end.
+ */
+static void *
+pipe_reader(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct chunk *cur, *next;
+	size_t cut;
+	ssize_t n;
+
+	cur = ring_pop(&pl->freechunks);
+	cur->len = 0;
+	do {
+		if (atomic_load_explicit(&pl->stop, memory_order_relaxed)) {
+			cur->len = 0;
+			break;
+		}
+
+		if (cur->len == cur->size) {
+			cur->size *= 2;
+			if ((cur->buf = realloc(cur->buf, cur->size)) == NULL)
+				error("%s: out of memory\n", prog);
+		}
+
+		/* Read errors are reported by the main thread once all is done */
+		if ((n = read(pl->fd, cur->buf + cur->len, cur->size - cur->len)) == -1) {
+			pl->rerr = errno;
+			cur->len = 0;
+			break;
+		}
+		cur->len += (size_t)n;
+
+		/* Keep reading into this chunk until it is full or the file ends */
+		if (n > 0 && cur->len < cur->size)
+			continue;
+
+		cut = cur->len;
+		if (n > 0) {
+			while (cut > 0 && cur->buf[cut - 1] != '}')
+				cut--;
+			if (cut == 0)
+				continue;
+		}
+
+		/* Nothing left at the end of the file, cur is the end marker */
+		if (cut == 0)
+			break;
+
+		next = ring_pop(&pl->freechunks);
+		next->len = cur->len - cut;
+		if (next->len > next->size) {
+			next->size = next->len * 2;
+			if ((next->buf = realloc(next->buf, next->size)) == NULL)
+				error("%s: out of memory\n", prog);
+		}
+		memcpy(next->buf, cur->buf + cut, next->len);
+
+		cur->len = cut;
+		ring_push(&pl->chunks, cur);
+		cur = next;
+	} while (n > 0);
+
+	/* At the end of the file cur is empty and serves as the end marker */
+	cur->len = 0;
+	ring_push(&pl->chunks, cur);
+
+	return NULL;
+}
+
+
+/*
+ * Writer stage: format the rows of every batch into a large stdio
+ * buffer and hand the batch back to the parser
+ */
+static void *
+pipe_writer(void *arg)
+{
+	struct pipeline *pl = arg;
+	struct batch *b;
+	struct stream_lease sl;
+	size_t i;
+	int eof;
+
+	do {
+		b = ring_pop(&pl->batches);
+		for (i = 0; i < b->n; i++) {
+			memset(&sl, 0, sizeof(sl));
+			sl.lease.client_id = NAME_STREAM;
+			sl.lease.start = b->rec[i].start;
+			sl.lease.end = b->rec[i].end;
+			sl.client = PIPE_STR(b, b->rec[i].client);
+			sl.lease.ipaddr = PIPE_STR(b, b->rec[i].ipaddr);
+			sl.lease.macaddr = PIPE_STR(b, b->rec[i].macaddr);
+			sl.lease.state = PIPE_STR(b, b->rec[i].state);
+			sl.lease.abandoned = b->rec[i].abandoned;
+			sl.lease.decoded = LEASE_START | LEASE_END | LEASE_IPADDR | LEASE_MACADDR | LEASE_STATE;
+			output_lease(&sl.lease);
+		}
+		eof = b->eof;
+		ring_push(&pl->freebatches, b);
+	} while (!eof);
+
+	out_flush();
+	return NULL;
+}
+
+
+/*
+ * Copy a raw field into the string space of a batch.  Returns its
+ * offset, or PIPE_NONE if the lease did not carry the field.
+ */
+static size_t
+pipe_field(struct batch *b, const struct dhl_field *f)
+{
+	size_t off;
+
+	if (f->ptr == NULL)
+		return PIPE_NONE;
+
+	while (b->used + f->len + 1 > b->size) {
+		b->size *= 2;
+		if ((b->strs = realloc(b->strs, b->size)) == NULL)
+			error("%s: out of memory\n", prog);
+	}
+
+	off = b->used;
+	b->used += dhl_field_copy(f, b->strs + off, f->len + 1) + 1;
+	return off;
+}
+
+
+/*
+ * Parser callback for the pipeline: filter the lease and add it to the
+ * current batch, passing the batch on to the writer once it is full
+ */
+static int
+pipe_lease(const struct dhl_lease *dl, void *arg)
+{
+	struct pipeline *pl = arg;
+	struct pipe_rec *r;
+	struct stream_lease sl;
+	int pass;
+
+	memset(&sl, 0, sizeof(sl));
+	sl.lease.client_id = NAME_STREAM;
+	sl.lease.raw_start = dl->raw_starts;
+	sl.lease.raw_end = dl->raw_ends;
+	sl.lease.raw_ipaddr = dl->raw_ipaddr;
+	sl.lease.raw_macaddr = dl->raw_macaddr;
+	sl.lease.raw_state = dl->raw_state;
+
+	/* The hostname is only decoded for -c, the batch takes the raw one */
+	if (cflag)
+		sl.client = decode_field(&dl->raw_hostname);
+
+	pass = filter_lease(&sl.lease);
+	free(sl.client);
+	if (!pass)
+		return 0;
+
+	if (pl->cur == NULL) {
+		pl->cur = ring_pop(&pl->freebatches);
+		pl->cur->n = 0;
+		pl->cur->used = 0;
+	}
+
+	r = &pl->cur->rec[pl->cur->n++];
+	r->start = lease_start(&sl.lease);
+	r->end = lease_end(&sl.lease);
+	r->client = pipe_field(pl->cur, &dl->raw_hostname);
+	r->ipaddr = pipe_field(pl->cur, &sl.lease.raw_ipaddr);
+	r->macaddr = pipe_field(pl->cur, &sl.lease.raw_macaddr);
+	r->state = pipe_field(pl->cur, &sl.lease.raw_state);
+	r->abandoned = dl->abandoned;
+
+	if (pl->cur->n == PIPE_BATCH) {
+		ring_push(&pl->batches, pl->cur);
+		pl->cur = NULL;
+	}
+	return 0;
+}
+
+
+/*
+ * Show the leases through a three stage pipeline so that reading the
+ * lease file, parsing it and writing the output overlap: a reader
+ * thread, the parser in the main thread and a writer thread.  Chunks
+ * of the file and batches of parsed leases are passed on through
+ * lock-free rings, and handed back through another pair of rings for
+ * reuse.  As rows are written before the whole file has been seen, the
+ * columns have a fixed width.
+ */
+static void
+output_pipelined(const char *filename)
+{
+	struct dhl_parser *parser;
+	struct pipeline pl;
+	struct chunk *c;
+	struct batch *b;
+	pthread_t reader, writer;
+	size_t i;
+	int err, perr;
+
+	memset(&pl, 0, sizeof(pl));
+	atomic_init(&pl.stop, 0);
+	if ((pl.fd = open(filename, O_RDONLY)) == -1)
+		error("%s: couldn't open lease file %s: %s\n", prog, filename, strerror(errno));
+	(void)posix_fadvise(pl.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	ring_init(&pl.chunks, PIPE_CHUNKS);
+	ring_init(&pl.freechunks, PIPE_CHUNKS);
+	ring_init(&pl.batches, PIPE_BATCHES);
+	ring_init(&pl.freebatches, PIPE_BATCHES);
+
+	for (i = 0; i < PIPE_CHUNKS; i++) {
+		if ((c = calloc(1, sizeof(*c))) == NULL ||
+		    (c->buf = malloc(PIPE_CHUNK_SIZE)) == NULL)
+			error("%s: out of memory\n", prog);
+		c->size = PIPE_CHUNK_SIZE;
+		ring_push(&pl.freechunks, c);
+	}
+	for (i = 0; i < PIPE_BATCHES; i++) {
+		if ((b = calloc(1, sizeof(*b))) == NULL ||
+		    (b->strs = malloc(PIPE_BATCH * 64)) == NULL)
+			error("%s: out of memory\n", prog);
+		b->size = PIPE_BATCH * 64;
+		ring_push(&pl.freebatches, b);
+	}
+
+	columns[COL_CLIENT].width = MAX(columns[COL_CLIENT].width, PIPE_CLIENT_WIDTH);
+	columns[COL_IPADDR].width = MAX(columns[COL_IPADDR].width, sizeof("255.255.255.255") - 1);
+	columns[COL_MACADDR].width = MAX(columns[COL_MACADDR].width, sizeof("00:00:00:00:00:00") - 1);
+	columns[COL_START].width = MAX(columns[COL_START].width, TIMESTR_WIDTH);
+	columns[COL_END].width = MAX(columns[COL_END].width, TIMESTR_WIDTH);
+	columns[COL_STATE].width = MAX(columns[COL_STATE].width, sizeof("abandoned") - 1);
+
+	output_header();
+
+	pipelining = 1;
+	if ((err = pthread_create(&reader, NULL, pipe_reader, &pl)) != 0 ||
+	    (err = pthread_create(&writer, NULL, pipe_writer, &pl)) != 0)
+		error("%s: couldn't start pipeline: %s\n", prog, strerror(err));
+
+	if ((parser = dhl_parser_new()) == NULL)
+		error("%s: out of memory\n", prog);
+	dhl_parser_setlazy(parser, 1);
+
+	/*
+	 * Every chunk ends on a block boundary and continues the previous
+	 * one.  After a parse error the reader is stopped and whatever it
+	 * has read already is passed over, so that both threads can finish
+	 * before the error is reported.
+	 */
+	perr = dhl_parse_buffer(parser, NULL, 0, pipe_lease, &pl);
+	while ((c = ring_pop(&pl.chunks))->len > 0) {
+		if (perr == DHL_OK && (perr = dhl_parse_next(parser, c->buf, c->len)) != DHL_OK)
+			atomic_store_explicit(&pl.stop, 1, memory_order_relaxed);
+		ring_push(&pl.freechunks, c);
+	}
+
+	if (pl.cur == NULL) {
+		pl.cur = ring_pop(&pl.freebatches);
+		pl.cur->n = 0;
+	}
+	pl.cur->eof = 1;
+	ring_push(&pl.batches, pl.cur);
+
+	pthread_join(reader, NULL);
+	pthread_join(writer, NULL);
+	pipelining = 0;
+	close(pl.fd);
+
+	if (pl.rerr != 0)
+		error("%s: failed to read from lease file %s: %s\n", prog, filename, strerror(pl.rerr));
+	if (perr != DHL_OK)
+		error("%s: %s: %s\n", prog, filename, dhl_parser_error(parser));
+	dhl_parser_free(parser);
+}
+
+
+/*
+ * Parse a size given with an optional K, M or G suffix
+ */
+static size_t
+parse_size_arg(const char *arg)
+{
+	unsigned long long size;
+	char *end;
+
+	errno = 0;
+	size = strtoull(arg, &end, 10);
+	if (errno != 0 || end == arg)
+		error("%s: invalid size '%s'\n", prog, arg);
+
+	switch (toupper((unsigned char)*end)) {
+		case 'G':
+			size *= 1024;
+			/* FALLTHROUGH */
+		case 'M':
+			size *= 1024;
+			/* FALLTHROUGH */
+		case 'K':
+			size *= 1024;
+			end++;
+			break;
+		case '\0':
+			break;
+		default:
+			error("%s: invalid size '%s'\n", prog, arg);
+	}
+
+	if (*end != '\0' && strcasecmp(end, "B") != 0)
+		error("%s: invalid size '%s'\n", prog, arg);
+
+	return (size_t)size;
+}
+
+
+/*
+ * Records are ordered by MAC address, newest lease first, so the first
+ * record of every MAC address is the one -d keeps
+ */
+static int
+extrec_cmp(const void *p1, const void *p2)
+{
+	const struct extrec *r1 = *(struct extrec * const *)p1;
+	const struct extrec *r2 = *(struct extrec * const *)p2;
+
+	if (r1->mac != r2->mac)
+		return (r1->mac < r2->mac) ? -1 : 1;
+	if (r1->end != r2->end)
+		return (r1->end > r2->end) ? -1 : 1;
+	if (r1->seq != r2->seq)
+		return (r1->seq > r2->seq) ? -1 : 1;
+	return 0;
+}
+
+
+static size_t
+extrec_size(const struct extrec *r)
+{
+	size_t size;
+
+	size = sizeof(*r) + r->iplen + r->maclen + r->clientlen + r->statelen + 4;
+	return (size + 7) & ~(size_t)7;
+}
+
+
+/*
+ * Create an anonymous temporary file for a run, in $TMPDIR if set
+ */
+static FILE *
+ext_tmpfile(void)
+{
+	const char *tmpdir;
+	char path[1024];
+	FILE *f;
+	int fd;
+
+	if ((tmpdir = getenv("TMPDIR")) == NULL)
+		tmpdir = "/tmp";
+
+	snprintf(path, sizeof(path), "%s/%s.XXXXXX", tmpdir, prog);
+	if ((fd = mkstemp(path)) == -1 || (f = fdopen(fd, "w+")) == NULL)
+		error("%s: couldn't create temporary file in %s: %s\n", prog, tmpdir, strerror(errno));
+	unlink(path);
+
+	return f;
+}
+
+
+/*
+ * Reopen a rewound run for reading through a buffer of bufsize bytes at
+ * buf, or allocated by stdio if buf is NULL.  The buffer of a stream can
+ * only be set before it is first used, so the run gets a fresh stream
+ * rather than having it changed.
+ */
+static FILE *
+ext_reopen(FILE *f, char *buf, size_t bufsize)
+{
+	FILE *rf;
+	int fd;
+
+	if ((fd = dup(fileno(f))) == -1 || fclose(f) != 0 ||
+	    lseek(fd, 0, SEEK_SET) == -1 || (rf = fdopen(fd, "r")) == NULL)
+		error("%s: failed to reopen temporary file: %s\n", prog, strerror(errno));
+	if (setvbuf(rf, buf, _IOFBF, bufsize) != 0)
+		error("%s: out of memory\n", prog);
+
+	return rf;
+}
+
+
+/*
+ * Write the sorted records of the current run to a temporary file,
+ * dropping all but the newest lease per MAC address with -d.  Once
+ * EXT_FANIN runs have been spilled they are merged into one, reading
+ * them through the now empty arena, so the number of open temporary
+ * files stays bounded however large the lease file is.
+ */
+static void
+ext_spill(struct extsort *es)
+{
+	FILE *f;
+	size_t i;
+
+	if (es->nrecs == 0)
+		return;
+
+	qsort(es->recs, es->nrecs, sizeof(*es->recs), extrec_cmp);
+
+	f = ext_tmpfile();
+
+	for (i = 0; i < es->nrecs; i++) {
+		if (dflag && i > 0 && es->recs[i]->mac == es->recs[i - 1]->mac)
+			continue;
+		if (fwrite(es->recs[i], extrec_size(es->recs[i]), 1, f) != 1)
+			error("%s: failed to write temporary file: %s\n", prog, strerror(errno));
+	}
+
+	if (fflush(f) != 0)
+		error("%s: failed to write temporary file: %s\n", prog, strerror(errno));
+	rewind(f);
+	es->runs[es->nruns++] = f;
+
+	es->used = 0;
+	es->nrecs = 0;
+
+	if (es->nruns == EXT_FANIN) {
+		f = ext_tmpfile();
+		ext_merge(es->runs, es->nruns, f, es->arena, es->size / EXT_FANIN);
+		if (fflush(f) != 0)
+			error("%s: failed to write temporary file: %s\n", prog, strerror(errno));
+		rewind(f);
+		es->runs[0] = f;
+		es->nruns = 1;
+	}
+}
+
+
+/*
+ * Add a lease to the current run as a compact record, spilling the run
+ * to disk first if the record does not fit
+ */
+static void
+ext_add(struct extsort *es, struct lease_t *p)
+{
+	struct extrec r, *rp;
+	const char *client;
+	uint64_t mac;
+	char *s;
+
+	memset(&r, 0, sizeof(r));
+	r.mac = (mac_to_key(lease_macaddr(p), &mac) == 0) ? mac : UINT64_MAX;
+	r.start = lease_start(p);
+	r.end = lease_end(p);
+	r.seq = p->seq;
+	r.abandoned = p->abandoned;
+	r.iplen = lease_ipaddr(p) ? strlen(p->ipaddr) : 0;
+	r.maclen = lease_macaddr(p) ? strlen(p->macaddr) : 0;
+	client = lease_client(p);
+	r.clientlen = client ? strlen(client) : 0;
+	r.statelen = lease_state(p) ? strlen(p->state) : 0;
+	r.flags = (p->macaddr ? EXT_MACADDR : 0) | (client ? EXT_CLIENT : 0) |
+	    (p->state ? EXT_STATE : 0);
+
+	if (extrec_size(&r) > es->size)
+		error("%s: --mem-limit is too small for lease %s\n", prog, p->ipaddr);
+
+	if (es->used + extrec_size(&r) > es->size || es->nrecs == es->maxrecs)
+		ext_spill(es);
+
+	rp = (struct extrec *)(es->arena + es->used);
+	*rp = r;
+	s = (char *)(rp + 1);
+	memcpy(s, p->ipaddr ? p->ipaddr : "", r.iplen + 1);
+	s += r.iplen + 1;
+	memcpy(s, p->macaddr ? p->macaddr : "", r.maclen + 1);
+	s += r.maclen + 1;
+	memcpy(s, client ? client : "", r.clientlen + 1);
+	s += r.clientlen + 1;
+	memcpy(s, p->state ? p->state : "", r.statelen + 1);
+
+	es->used += extrec_size(&r);
+	es->recs[es->nrecs++] = rp;
+}
+
+
+/*
+ * Read the next record of a run into its reader.  Returns 0 at the end
+ * of the run.
+ */
+static int
+ext_read(struct extreader *rd)
+{
+	struct extrec r;
+	size_t size;
+
+	if (fread(&r, sizeof(r), 1, rd->f) != 1) {
+		if (ferror(rd->f))
+			error("%s: failed to read temporary file\n", prog);
+		return 0;
+	}
+
+	size = extrec_size(&r);
+	if (size > rd->cap) {
+		if ((rd->rec = realloc(rd->rec, size)) == NULL)
+			error("%s: out of memory\n", prog);
+		rd->cap = size;
+	}
+
+	*rd->rec = r;
+	if (fread(rd->rec + 1, size - sizeof(r), 1, rd->f) != 1)
+		error("%s: failed to read temporary file\n", prog);
+
+	return 1;
+}
+
+
+static void
+output_extrec(const struct extrec *r)
+{
+	struct stream_lease sl;
+	char *s;
+
+	memset(&sl, 0, sizeof(sl));
+	sl.lease.client_id = NAME_STREAM;
+	s = (char *)(r + 1);
+	sl.lease.ipaddr = s;
+	s += r->iplen + 1;
+	sl.lease.macaddr = (r->flags & EXT_MACADDR) ? s : NULL;
+	s += r->maclen + 1;
+	sl.client = (r->flags & EXT_CLIENT) ? s : NULL;
+	s += r->clientlen + 1;
+	sl.lease.state = (r->flags & EXT_STATE) ? s : NULL;
+	sl.lease.start = r->start;
+	sl.lease.end = r->end;
+	sl.lease.abandoned = r->abandoned;
+	sl.lease.decoded = LEASE_START | LEASE_END | LEASE_IPADDR | LEASE_MACADDR | LEASE_STATE;
+
+	output_lease(&sl.lease);
+}
+
+
+static void
+heap_down(struct extreader **heap, size_t n, size_t i)
+{
+	struct extreader *tmp;
+	size_t c;
+
+	while ((c = 2 * i + 1) < n) {
+		if (c + 1 < n && extrec_cmp(&heap[c + 1]->rec, &heap[c]->rec) < 0)
+			c++;
+		if (extrec_cmp(&heap[i]->rec, &heap[c]->rec) <= 0)
+			break;
+		tmp = heap[i];
+		heap[i] = heap[c];
+		heap[c] = tmp;
+		i = c;
+	}
+}
+
+
+/*
+ * k-way merge of sorted runs, either into a new run in out or, if out
+ * is NULL, straight to the output.  Each run is read through its own
+ * buffer of bufsize bytes so all disk I/O stays sequential; run i uses
+ * buf + i * bufsize, or a buffer of its own if buf is NULL.
+ */
+static void
+ext_merge(FILE **runs, size_t nruns, FILE *out, char *buf, size_t bufsize)
+{
+	struct extreader *rd, **heap;
+	uint64_t lastmac;
+	size_t i, n;
+	int first;
+
+	if ((rd = calloc(nruns, sizeof(*rd))) == NULL ||
+	    (heap = calloc(nruns, sizeof(*heap))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	n = 0;
+	for (i = 0; i < nruns; i++) {
+		rd[i].f = ext_reopen(runs[i], buf ? buf + i * bufsize : NULL, bufsize);
+		if (ext_read(&rd[i]))
+			heap[n++] = &rd[i];
+	}
+	for (i = n / 2; i-- > 0; )
+		heap_down(heap, n, i);
+
+	first = 1;
+	lastmac = 0;
+	while (n > 0) {
+		if (!dflag || first || heap[0]->rec->mac != lastmac) {
+			if (out == NULL)
+				output_extrec(heap[0]->rec);
+			else if (fwrite(heap[0]->rec, extrec_size(heap[0]->rec), 1, out) != 1)
+				error("%s: failed to write temporary file: %s\n", prog, strerror(errno));
+		}
+		first = 0;
+		lastmac = heap[0]->rec->mac;
+
+		if (!ext_read(heap[0]))
+			heap[0] = heap[--n];
+		heap_down(heap, n, 0);
+	}
+
+	for (i = 0; i < nruns; i++) {
+		fclose(rd[i].f);
+		free(rd[i].rec);
+	}
+	free(rd);
+	free(heap);
+}
+
+
+/*
+ * Parser callback for --mem-limit: filter the lease and hand it to the
+ * external sort, keeping nothing else around
+ */
+static int
+ext_lease(const struct dhl_lease *dl, void *arg)
+{
+	struct extsort *es = arg;
+	struct stream_lease sl;
+
+	memset(&sl, 0, sizeof(sl));
+	sl.lease.client_id = NAME_STREAM;
+	sl.lease.raw_start = dl->raw_starts;
+	sl.lease.raw_end = dl->raw_ends;
+	sl.client = decode_field(&dl->raw_hostname);
+	sl.lease.raw_ipaddr = dl->raw_ipaddr;
+	sl.lease.raw_macaddr = dl->raw_macaddr;
+	sl.lease.raw_state = dl->raw_state;
+	sl.lease.abandoned = dl->abandoned;
+	sl.lease.seq = nleases++;
+
+	if (filter_lease(&sl.lease) && (!dflag || lease_macaddr(&sl.lease) != NULL)) {
+		widen(&sl.lease);
+		ext_add(es, &sl.lease);
+	}
+
+	free(sl.client);
+	free(sl.lease.ipaddr);
+	free(sl.lease.macaddr);
+	free(sl.lease.state);
+	return 0;
+}
+
+
+/*
+ * Show the leases sorted by MAC address, newest first, and with -d only
+ * the newest lease per MAC address, using no more than about limit
+ * bytes of memory.  Leases are gathered into sorted runs which are
+ * spilled to temporary files as memory fills up and then merged.
+ */
+static void
+output_mem_limited(const char *filename, size_t limit)
+{
+	struct dhl_parser *parser;
+	struct extsort es;
+	size_t i;
+
+	if (limit < EXT_OVERHEAD + EXT_MIN_MEM)
+		error("%s: --mem-limit must be at least %zuK\n", prog, (size_t)(EXT_OVERHEAD + EXT_MIN_MEM + 1023) / 1024);
+
+	/* The fixed buffers come off the top, the rest is for sorting */
+	limit -= EXT_OVERHEAD;
+
+	memset(&es, 0, sizeof(es));
+	es.size = limit / 4 * 3;
+	es.maxrecs = limit / 4 / sizeof(*es.recs);
+	if ((es.arena = malloc(es.size)) == NULL ||
+	    (es.recs = calloc(es.maxrecs, sizeof(*es.recs))) == NULL)
+		error("%s: out of memory\n", prog);
+
+	if ((parser = dhl_parser_new()) == NULL)
+		error("%s: out of memory\n", prog);
+	dhl_parser_setlazy(parser, 1);
+
+	switch (dhl_parse_path(parser, filename, ext_lease, &es)) {
+		case DHL_OK:
+			break;
+		case DHL_EIO:
+			/* The parser has named the lease file already */
+			error("%s: %s\n", prog, dhl_parser_error(parser));
+			break;
+		default:
+			error("%s: %s: %s\n", prog, filename, dhl_parser_error(parser));
+	}
+	dhl_parser_free(parser);
+
+	output_header();
+
+	/* Everything fit in memory */
+	if (es.nruns == 0) {
+		qsort(es.recs, es.nrecs, sizeof(*es.recs), extrec_cmp);
+		for (i = 0; i < es.nrecs; i++) {
+			if (dflag && i > 0 && es.recs[i]->mac == es.recs[i - 1]->mac)
+				continue;
+			output_extrec(es.recs[i]);
+		}
+		return;
+	}
+
+	ext_spill(&es);
+	free(es.arena);
+	free(es.recs);
+
+	ext_merge(es.runs, es.nruns, NULL, NULL, limit / es.nruns);
+}
+
+
+int
+main(int argc, char **argv)
+{
+	int g;
+        char *tmp;
+	char *fval;
+	time_t told, tnew;
+
+        if ((tmp = strrchr(argv[0], '/')) != NULL)
+                prog = tmp + 1;
+	else
 		prog = argv[0];
 
-	while ((g = getopt(argc, argv, opts)) != -1) {
+	while ((g = getopt_long(argc, argv, opts, longopts, NULL)) != -1) {
 		switch (g) {
+			case OPT_AT:
+				atflag = 1;
+				tfrom = tto = parse_time_arg(optarg);
+				break;
+			case OPT_BETWEEN:
+				if (optind >= argc)
+					usage();
+				betweenflag = 1;
+				tfrom = parse_time_arg(optarg);
+				tto = parse_time_arg(argv[optind++]);
+				break;
+			case OPT_DIFF:
+				if (optind >= argc)
+					usage();
+				diffflag = 1;
+				asprintf(&diffold, "%s", optarg);
+				asprintf(&diffnew, "%s", argv[optind++]);
+				break;
+			case OPT_DIFF_SINCE:
+				diffsinceflag = 1;
+				tfrom = parse_time_arg(optarg);
+				break;
+			case OPT_MEM_LIMIT:
+				memlimitflag = 1;
+				memlimit = parse_size_arg(optarg);
+				break;
+			case OPT_CONFLICTS:
+				conflictsflag = 1;
+				break;
+			case OPT_PIPELINE:
+				pipelineflag = 1;
+				break;
+			case OPT_COLUMNS:
+				asprintf(&colval, "%s", optarg);
+				break;
 			case 'a':
 				aflag = 1;
 				break;
@@ -765,15 +2493,71 @@ main(int argc, char **argv)
 	if (aflag && xflag)
 		error("%s: the -a and -x flags are mutually exclusive\n", prog);
 
+	if (atflag && betweenflag)
+		error("%s: the --at and --between options are mutually exclusive\n", prog);
+
+	if ((atflag || betweenflag) + diffflag + diffsinceflag + memlimitflag + conflictsflag + pipelineflag > 1)
+		error("%s: --at, --between, --diff, --diff-since, --mem-limit, --conflicts and --pipeline are mutually exclusive\n", prog);
+
+	if (pipelineflag && dflag)
+		error("%s: --pipeline can't be used with -d\n", prog);
+
+	if (diffflag && fflag)
+		error("%s: --diff takes its lease files as arguments, -f can't be used\n", prog);
+
+	if (betweenflag && compare_time(tfrom, tto) > 0)
+		error("%s: --between expects the earlier time first\n", prog);
+
 	if (!fflag)
 		asprintf(&fval, "%s", DEFAULT_LEASE_FILE);
 
+	parse_columns(colval != NULL ? colval : DEFAULT_COLUMNS);
+	atexit(out_flush);
+
+	if (diffflag) {
+		if (vflag)
+			printf("comparing lease files: %s %s\n", diffold, diffnew);
+
+		/* Each snapshot is judged as of when its file was written */
+		told = load_lease_file(diffold);
+		TAILQ_CONCAT(&oldhead, &head, entities);
+		tnew = load_lease_file(diffnew);
+		output_diff(&oldhead, told, &head, tnew, 0);
+		return 0;
+	}
+
 	if (vflag)
 		printf("using lease file: %s\n", fval);
 
+	if (memlimitflag) {
+		output_mem_limited(fval, memlimit);
+		return 0;
+	}
+
+	if (pipelineflag) {
+		output_pipelined(fval);
+		return 0;
+	}
+
+	load_lease_file(fval);
+
+	if (diffsinceflag) {
+		output_diff(&head, tfrom, &head, time(NULL), 1);
+		return 0;
+	}
 
-	open_lease_file(fval);
-	parse_lease_file();
+	if (conflictsflag) {
+		output_conflicts();
+		return 0;
+	}
+
+	if (dflag)
+		remove_duplicates();
+
+	if (atflag || betweenflag)
+		output_query(tfrom, tto);
+	else
+		output_leases();
 
 	return 0;
 }
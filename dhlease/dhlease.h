@@ -27,52 +27,370 @@ of the authors and should not be interpreted as representing official policies,
 either expressed or implied, of the DHLEASE project.
 */
 
-#define TOK_INVALID_TOKEN	0
-#define TOK_LEASE		1
-#define TOK_HARDWARE		2
-#define TOK_ETHERNET		3
-#define TOK_STARTS		4
-#define TOK_ENDS		5
-#define TOK_CLIENT_HOSTNAME	6
-#define TOK_ABANDONED		7
-#define CHAR_CURLY_BRACE_START	'{'
-#define CHAR_CURLY_BRACE_END	'}'
-#define CHAR_SEMICOLON		';'
 #define DEFAULT_LEASE_FILE	"/var/db/dhcpd.leases"
 
-static void   usage(void);
-static void   open_lease_file(const char *filename);
-static void   parse_lease_file(void);
-static void   parse_ip_address(void);
-static void   parse_ethernet_address(void);
-static void   parse_client_hostname(void);
-static void   read_string_to_semicolon(void);
-static void   check_block_scope(void);
-static void   output_leases(const size_t cltlen, const size_t iplen, const size_t maclen, const size_t slen, const size_t elen);
-static void   seek_char(const unsigned char chr);
-static char   *time_to_string(const time_t *time);
-static time_t parse_date_string(void);
-static time_t string_to_time(const char *datestr);
-static int    compare_time(const time_t t1, const time_t t2);
-static int    has_lease_expired(const time_t tend);
-static int    get_token(int *count, int *found);
-static int    get_char(void);
-static int    keyword_cmp(const void *p1, const void *p2);
-static int    lookup(char *value);
-static int    peek_char(void);
-static int    error(const char *fmt, ...);
-static int    match_partial_string(const char *src, const char *search);
+/* <sys/cdefs.h> provides this on BSD */
+#ifndef __unused
+#define __unused		__attribute__((__unused__))
+#endif
+#define TIMESTR_LEN		32
+#define TIMESTR_WIDTH		24	/* as "Thu Jan  1 00:00:00 1970" */
+
+/* Lease fields decoded so far, see lease_t.decoded */
+#define LEASE_START		0x01
+#define LEASE_END		0x02
+#define LEASE_IPADDR		0x08
+#define LEASE_MACADDR		0x10
+#define LEASE_STATE		0x20
+
+/* Client hostname pool, see intern_client() */
+#define NAME_NONE		0	/* ID of leases without a hostname */
+#define NAME_STREAM		UINT32_MAX	/* ID of a struct stream_lease */
+#define NAME_MIN_SLOTS		256	/* a power of 2 */
+
+/* Output columns, see --columns */
+#define COL_CLIENT		0
+#define COL_IPADDR		1
+#define COL_MACADDR		2
+#define COL_START		3
+#define COL_END			4
+#define COL_EXPIRED		5
+#define COL_STATE		6
+#define COL_ABANDONED		7
+#define COL_MAX			8
+#define DEFAULT_COLUMNS		"client,ip,mac,starts,ends,expired"
+#define LABEL_WIDTH		8	/* CHANGE and CONFLICT columns */
+#define OUTBUF_SIZE		(64 * 1024)
+
+/* Long-only options */
+#define OPT_AT			256
+#define OPT_BETWEEN		257
+#define OPT_DIFF		258
+#define OPT_DIFF_SINCE		259
+#define OPT_MEM_LIMIT		260
+#define OPT_CONFLICTS		261
+#define OPT_PIPELINE		262
+#define OPT_COLUMNS		263
 
-static TAILQ_HEAD(thead, lease_t) head = TAILQ_HEAD_INITIALIZER(head);
+/* Pipelined output for --pipeline */
+#define PIPE_CHUNKS		4		/* file chunks in flight, a power of 2 */
+#define PIPE_CHUNK_SIZE		(1024 * 1024)
+#define PIPE_BATCHES		8		/* lease batches in flight, a power of 2 */
+#define PIPE_BATCH		1024		/* leases per batch */
+#define PIPE_CLIENT_WIDTH	16
+#define PIPE_NONE		SIZE_MAX
+#define PIPE_STR(b, off)	((off) == PIPE_NONE ? NULL : (b)->strs + (off))
+
+/* Conflict kinds reported by --conflicts */
+#define CFL_IP			0	/* IP address held by several MACs */
+#define CFL_MAC			1	/* MAC address holding several IPs */
+
+/* External sort for --mem-limit */
+#define EXT_MIN_MEM		(64 * 1024)	/* least memory for sorting */
+#define EXT_OVERHEAD		(DHL_READSIZE + OUTBUF_SIZE + 2 * BUFSIZ)	/* parser, output and run buffers */
+#define EXT_FANIN		64	/* runs merged at once */
+#define EXT_MACADDR		0x01	/* record has a MAC address */
+#define EXT_CLIENT		0x02	/* record has a client hostname */
+#define EXT_STATE		0x04	/* record has a binding state */
+
+/* Change categories reported by --diff, in output order */
+#define CHG_NEW			0
+#define CHG_RELEASED		1
+#define CHG_REBOUND		2
+#define CHG_MOVED		3
+#define CHG_RENAMED		4
+#define CHG_MAX			5
 
 struct lease_t {
 	time_t		start;
 	time_t		end;
-	char		*hostname;
-	char		*client;
 	char		*ipaddr;
 	char		*macaddr;
+	char		*state;
 	int		abandoned;
 	int		expired;
+	int		decoded;	/* LEASE_* fields decoded so far */
+	uint32_t	client_id;	/* interned hostname, NAME_NONE or NAME_STREAM */
+	size_t		seq;		/* position in the lease file(s) */
+
+	/* The fields as found in the lease file */
+	struct dhl_field raw_start;
+	struct dhl_field raw_end;
+	struct dhl_field raw_ipaddr;
+	struct dhl_field raw_macaddr;
+	struct dhl_field raw_state;
 	TAILQ_ENTRY(lease_t) entities;
 };
+
+TAILQ_HEAD(thead, lease_t);
+
+/*
+ * A lease that is not kept in memory, as --pipeline and --mem-limit
+ * handle them.  It carries its hostname decoded rather than in the
+ * pool, and its client_id is NAME_STREAM.
+ */
+struct stream_lease {
+	struct lease_t	lease;		/* must come first */
+	char		*client;
+};
+
+/*
+ * Interned client hostname.  raw points into the mapped lease file;
+ * str is decoded on first use, and match caches the -c result: -1
+ * until tried, then 0 or 1.
+ */
+struct name {
+	struct dhl_field raw;
+	char		*str;
+	uint32_t	hash;
+	int		match;
+};
+
+/* Hostnames by ID, and an open addressing hash table of their IDs */
+struct namepool {
+	struct name	*ent;
+	size_t		n;		/* entries in use, ent[0] is never used */
+	size_t		cap;
+	uint32_t	*slot;
+	size_t		mask;		/* number of slots - 1 */
+};
+
+/*
+ * Leases sorted by a key (IP or MAC address) and, within each key, by
+ * start time.  maxend[i] holds the latest end time among the entries of
+ * the same key up to and including i, which lets interval queries stop
+ * walking back as soon as no earlier lease can still overlap.  Group g
+ * of entries sharing a key occupies ent[group[g]] up to ent[group[g + 1]].
+ */
+struct lease_index {
+	struct lease_t	**ent;
+	time_t		*maxend;
+	size_t		nent;
+	size_t		*group;
+	size_t		ngroups;
+	const char	*(*key)(struct lease_t *);
+	int		(*tokey)(const char *, uint64_t *);	/* tells complete keys */
+};
+
+/*
+ * Latest-per-key snapshot entry.  The key is the binary form of an IPv4
+ * address or a MAC address so snapshots sort and merge without string
+ * comparisons.
+ */
+struct snapent {
+	uint64_t	key;
+	struct lease_t	*lease;
+};
+
+struct snapshot {
+	struct snapent	*ent;
+	size_t		nent;
+};
+
+struct change {
+	int		what;
+	struct lease_t	*old;
+	struct lease_t	*new;
+};
+
+/*
+ * Compact lease record used by the external sort.  The IP address, MAC
+ * address, client hostname and binding state follow as NUL-terminated
+ * strings, and the whole record is padded to a multiple of 8 bytes.
+ */
+struct extrec {
+	uint64_t	mac;		/* MAC address key, UINT64_MAX if none */
+	int64_t		start;
+	int64_t		end;
+	uint64_t	seq;
+	uint16_t	iplen;
+	uint16_t	maclen;
+	uint16_t	clientlen;
+	uint16_t	statelen;
+	uint8_t		flags;		/* EXT_* */
+	uint8_t		abandoned;
+};
+
+/* The run being gathered in memory, and the runs spilled and not yet merged */
+struct extsort {
+	char		*arena;
+	size_t		used;
+	size_t		size;
+	struct extrec	**recs;
+	size_t		nrecs;
+	size_t		maxrecs;
+	FILE		*runs[EXT_FANIN];
+	size_t		nruns;
+};
+
+/* Sequential reader of a spilled run */
+struct extreader {
+	FILE		*f;
+	struct extrec	*rec;		/* current record */
+	size_t		cap;
+};
+
+/* Lease as seen by the conflict detection, with its keys at hand */
+struct cflent {
+	uint64_t	ip;
+	uint64_t	mac;
+	time_t		start;
+	time_t		end;
+	size_t		group;
+	struct lease_t	*lease;
+};
+
+struct conflict {
+	int		what;
+	struct lease_t	*lease;
+	struct lease_t	*with;		/* earlier lease it overlaps */
+};
+
+/* Lock-free single-producer/single-consumer ring of pointers */
+struct ring {
+	void		**slot;
+	size_t		mask;		/* number of slots - 1 */
+	atomic_size_t	head;		/* next slot to fill, moved by the producer */
+	atomic_size_t	tail;		/* next slot to empty, moved by the consumer */
+};
+
+/* A piece of the lease file ending on a lease block boundary */
+struct chunk {
+	char		*buf;
+	size_t		len;
+	size_t		size;
+};
+
+/* A parsed lease; strings are offsets into the batch, or PIPE_NONE */
+struct pipe_rec {
+	time_t		start;
+	time_t		end;
+	size_t		client;
+	size_t		ipaddr;
+	size_t		macaddr;
+	size_t		state;
+	int		abandoned;
+};
+
+struct batch {
+	struct pipe_rec	rec[PIPE_BATCH];
+	size_t		n;
+	int		eof;		/* last batch */
+	char		*strs;
+	size_t		used;
+	size_t		size;
+};
+
+struct pipeline {
+	int		fd;
+	int		rerr;		/* errno of a failed read, set by the reader */
+	atomic_int	stop;		/* tells the reader to stop early */
+	struct ring	chunks;		/* reader -> parser */
+	struct ring	freechunks;	/* parser -> reader */
+	struct ring	batches;	/* parser -> writer */
+	struct ring	freebatches;	/* writer -> parser */
+	struct batch	*cur;		/* batch being filled by the parser */
+};
+
+/*
+ * An output column.  measure gives the width a lease needs, or is NULL
+ * for columns as wide as their title; emit writes the field of a row.
+ */
+struct column {
+	const char	*name;		/* as given to --columns */
+	const char	*title;
+	size_t		(*measure)(struct lease_t *p);
+	void		(*emit)(struct lease_t *p, size_t width);
+	size_t		width;
+	int		shown;
+};
+
+static void   usage(void);
+static time_t load_lease_file(const char *filename);
+static int    store_lease(const struct dhl_lease *l, void *arg);
+static void   build_snapshot(struct snapshot *snap, struct thead *list, int (*tokey)(const char *, uint64_t *), const char *(*key)(struct lease_t *), int cutoff, time_t tcut);
+static void   diff_snapshots(const struct snapshot *old, const struct snapshot *new, time_t told, time_t tnew, int bymac);
+static void   add_change(int what, struct lease_t *old, struct lease_t *new);
+static void   output_diff(struct thead *oldlist, time_t told, struct thead *newlist, time_t tnew, int cutoff);
+static void   output_leases(void);
+static void   output_header(void);
+static void   output_lease(struct lease_t *p);
+static void   widen(struct lease_t *p);
+static void   parse_columns(const char *arg);
+static void   output_label(const char *label);
+static void   out_flush(void);
+static void   out_pad(const char *s, size_t width);
+static void   out_char(char c);
+static size_t measure_client(struct lease_t *p);
+static size_t measure_ipaddr(struct lease_t *p);
+static size_t measure_macaddr(struct lease_t *p);
+static size_t measure_time(struct lease_t *p __unused);
+static size_t measure_state(struct lease_t *p);
+static void   emit_client(struct lease_t *p, size_t width);
+static void   emit_ipaddr(struct lease_t *p, size_t width);
+static void   emit_macaddr(struct lease_t *p, size_t width);
+static void   emit_start(struct lease_t *p, size_t width);
+static void   emit_end(struct lease_t *p, size_t width);
+static void   emit_expired(struct lease_t *p, size_t width);
+static void   emit_state(struct lease_t *p, size_t width);
+static void   emit_abandoned(struct lease_t *p, size_t width);
+static void   output_query(time_t t1, time_t t2);
+static void   output_conflicts(void);
+static void   output_pipelined(const char *filename);
+static void   ring_init(struct ring *r, size_t size);
+static void   ring_wait(unsigned int *spins);
+static void   ring_push(struct ring *r, void *item);
+static void   *ring_pop(struct ring *r);
+static void   *pipe_reader(void *arg);
+static void   *pipe_writer(void *arg);
+static int    pipe_lease(const struct dhl_lease *dl, void *arg);
+static size_t pipe_field(struct batch *b, const struct dhl_field *f);
+static void   find_conflicts(struct cflent *ent, const size_t *start, size_t ngroups, int bymac);
+static void   add_conflict(int what, struct lease_t *lease, struct lease_t *with);
+static size_t partition_conflicts(struct cflent *ent, size_t n, int bymac, struct cflent *part, size_t **startp);
+static int    cflent_cmp(const void *p1, const void *p2);
+static int    is_active(struct lease_t *p);
+static size_t hash_key(uint64_t key, size_t mask);
+static void   output_mem_limited(const char *filename, size_t limit);
+static void   output_extrec(const struct extrec *r);
+static void   ext_add(struct extsort *es, struct lease_t *p);
+static void   ext_spill(struct extsort *es);
+static void   ext_merge(FILE **runs, size_t nruns, FILE *out, char *buf, size_t bufsize);
+static void   heap_down(struct extreader **heap, size_t n, size_t i);
+static FILE   *ext_tmpfile(void);
+static FILE   *ext_reopen(FILE *f, char *buf, size_t bufsize);
+static int    ext_read(struct extreader *rd);
+static int    ext_lease(const struct dhl_lease *dl, void *arg);
+static int    extrec_cmp(const void *p1, const void *p2);
+static size_t extrec_size(const struct extrec *r);
+static size_t parse_size_arg(const char *arg);
+static void   build_index(struct lease_index *idx, const char *(*key)(struct lease_t *), int (*tokey)(const char *, uint64_t *));
+static size_t query_index(const struct lease_index *idx, const char *search, time_t t1, time_t t2, struct lease_t **out);
+static size_t query_group(const struct lease_index *idx, size_t g, time_t t1, time_t t2, struct lease_t **out);
+static char   *time_to_string(const time_t *time, char *tbuf);
+static char   *decode_field(const struct dhl_field *f);
+static const char *map_lease_file(const char *filename, size_t *len, time_t *mtime);
+static time_t parse_time_arg(const char *arg);
+static int    compare_time(const time_t t1, const time_t t2);
+static int    has_lease_expired(const time_t tend);
+static int    error(const char *fmt, ...);
+static int    match_partial_string(const char *src, const char *search);
+static int    match_partial_field(const struct dhl_field *f, const char *search);
+static int    filter_lease(struct lease_t *p);
+static int    index_cmp(const void *p1, const void *p2);
+static int    snapent_cmp(const void *p1, const void *p2);
+static int    ip_to_key(const char *ipaddr, uint64_t *key);
+static int    mac_to_key(const char *macaddr, uint64_t *key);
+static int    is_bound(struct lease_t *p, time_t tref);
+static time_t lease_start(struct lease_t *p);
+static time_t lease_end(struct lease_t *p);
+static const char *lease_client(struct lease_t *p);
+static const char *lease_ipaddr(struct lease_t *p);
+static const char *lease_macaddr(struct lease_t *p);
+static const char *lease_state(struct lease_t *p);
+static uint32_t intern_client(const struct dhl_field *f);
+static uint32_t hash_field(const struct dhl_field *f);
+static int    match_client(struct lease_t *p);
+
+static struct thead head = TAILQ_HEAD_INITIALIZER(head);
+static struct thead oldhead = TAILQ_HEAD_INITIALIZER(oldhead);
@@ -0,0 +1,761 @@
+/*
+Copyright (c) 2018, Klaus Pedersen <klaus@brightstorm.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the DHLEASE project.
+*/
+
+/*
+ * Reentrant parser for ISC dhcpd lease files.  All state lives in a
+ * struct dhl_parser, errors are returned rather than acted upon, and
+ * leases are handed to a callback as soon as their block is closed, so
+ * several parsers may run at once, e.g. on separate threads.
+ *
+ * The scanner works on a buffer in memory and only records where each
+ * field of a lease is.  Fields are decoded when the lease is passed on,
+ * or not at all in lazy mode, where that is left to the caller.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libdhlease.h"
+
+#define TOK_INVALID_TOKEN	0
+#define TOK_LEASE		1
+#define TOK_HARDWARE		2
+#define TOK_ETHERNET		3
+#define TOK_STARTS		4
+#define TOK_ENDS		5
+#define TOK_CLIENT_HOSTNAME	6
+#define TOK_ABANDONED		7
+#define TOK_BINDING		8
+#define TOK_NEXT		9
+#define TOK_REWIND		10
+#define CHAR_CURLY_BRACE_START	'{'
+#define CHAR_CURLY_BRACE_END	'}'
+#define CHAR_SEMICOLON		';'
+#define DHL_BUFSIZE		2048
+
+struct dhl_parser {
+	const char	*buf;		/* buffer being scanned */
+	size_t		len;
+	size_t		pos;
+	dhl_lease_cb	cb;
+	void		*arg;
+	int		lazy;
+	int		inblock;	/* indicates whether we are inside a lease block */
+	int		count;		/* no. of valid tokens encountered */
+	int		line;
+	int		cpos;
+	int		err;
+	char		errmsg[256];
+	char		buffer[DHL_BUFSIZE];	/* current token */
+
+	/* The lease currently being parsed */
+	struct dhl_lease lease;
+	char		ipaddr[DHL_BUFSIZE];
+	char		macaddr[DHL_BUFSIZE];
+	char		hostname[DHL_BUFSIZE];
+	char		state[DHL_BUFSIZE];
+
+	/* Read buffer for dhl_parse_file() */
+	char		*rbuf;
+	size_t		rsize;
+};
+
+static int	set_error(struct dhl_parser *p, int err, const char *fmt, ...);
+static void	reset(struct dhl_parser *p, dhl_lease_cb cb, void *arg);
+static int	scan(struct dhl_parser *p);
+static void	begin_lease(struct dhl_parser *p);
+static void	end_lease(struct dhl_parser *p);
+static int	decode_lease(struct dhl_parser *p);
+static int	get_char(struct dhl_parser *p);
+static int	get_token(struct dhl_parser *p);
+static int	seek_char(struct dhl_parser *p, const unsigned char chr);
+static int	scan_to_semicolon(struct dhl_parser *p, struct dhl_field *f);
+static int	scan_word(struct dhl_parser *p, int quoted, struct dhl_field *f);
+static int	scan_date(struct dhl_parser *p, struct dhl_field *f);
+static int	check_block_scope(struct dhl_parser *p);
+static int	keyword_cmp(const void *p1, const void *p2);
+static int	lookup(const char *value);
+
+static const struct keywords {
+	const char	*name;
+	int		value;
+} keywords[] = {
+	{ "abandoned",		TOK_ABANDONED },
+	{ "binding",		TOK_BINDING },
+	{ "client-hostname",	TOK_CLIENT_HOSTNAME },
+	{ "ends",		TOK_ENDS },
+	{ "ethernet",		TOK_ETHERNET },
+	{ "hardware",		TOK_HARDWARE },
+	{ "lease",		TOK_LEASE },
+	{ "next",		TOK_NEXT },
+	{ "rewind",		TOK_REWIND },
+	{ "starts",		TOK_STARTS }
+};
+
+static const char *errstr[] = {
+	"no error",
+	"read error",
+	"syntax error",
+	"invalid date",
+	"aborted by callback"
+};
+
+
+/*
+ * Record an error.  Only the first error is kept, as later ones are
+ * usually fallout from it.  Returns the error code.
+ */
+static int
+set_error(struct dhl_parser *p, int err, const char *fmt, ...)
+{
+	va_list	arglist;
+
+	if (p->err != DHL_OK)
+		return p->err;
+
+	p->err = err;
+	va_start(arglist, fmt);
+	(void)vsnprintf(p->errmsg, sizeof(p->errmsg), fmt, arglist);
+	va_end(arglist);
+
+	return err;
+}
+
+
+static void
+reset(struct dhl_parser *p, dhl_lease_cb cb, void *arg)
+{
+	p->buf = NULL;
+	p->len = 0;
+	p->pos = 0;
+	p->cb = cb;
+	p->arg = arg;
+	p->inblock = 0;
+	p->count = 0;
+	p->line = 1;
+	p->cpos = 0;
+	p->err = DHL_OK;
+	p->errmsg[0] = '\0';
+	begin_lease(p);
+}
+
+
+static void
+begin_lease(struct dhl_parser *p)
+{
+	memset(&p->lease, 0, sizeof(p->lease));
+}
+
+
+/*
+ * Decode the raw fields of the current lease into the parser's storage
+ */
+static int
+decode_lease(struct dhl_parser *p)
+{
+	struct dhl_lease *l = &p->lease;
+
+	dhl_field_copy(&l->raw_ipaddr, p->ipaddr, sizeof(p->ipaddr));
+	l->ipaddr = p->ipaddr;
+
+	if (l->raw_macaddr.ptr != NULL) {
+		dhl_field_copy(&l->raw_macaddr, p->macaddr, sizeof(p->macaddr));
+		l->macaddr = p->macaddr;
+	}
+
+	if (l->raw_hostname.ptr != NULL) {
+		dhl_field_copy(&l->raw_hostname, p->hostname, sizeof(p->hostname));
+		l->hostname = p->hostname;
+	}
+
+	if (l->raw_state.ptr != NULL) {
+		dhl_field_copy(&l->raw_state, p->state, sizeof(p->state));
+		l->state = p->state;
+	}
+
+	if (l->raw_starts.ptr != NULL && dhl_field_time(&l->raw_starts, &l->starts) != DHL_OK)
+		return set_error(p, DHL_EDATE, "time conversion failed at line %d", p->line);
+
+	if (l->raw_ends.ptr != NULL && dhl_field_time(&l->raw_ends, &l->ends) != DHL_OK)
+		return set_error(p, DHL_EDATE, "time conversion failed at line %d", p->line);
+
+	return DHL_OK;
+}
+
+
+/*
+ * Hand the completed lease to the callback
+ */
+static void
+end_lease(struct dhl_parser *p)
+{
+	if (!p->lazy && decode_lease(p) != DHL_OK)
+		return;
+
+	if (p->cb != NULL && p->cb(&p->lease, p->arg) != 0)
+		set_error(p, DHL_EABORT, "parsing aborted at line %d", p->line);
+}
+
+
+/*
+ * Get the next byte from the buffer.  A closing curly brace ends the
+ * current lease block and passes the lease on.  Returns -1 at the end
+ * of the buffer or on error.
+ */
+static int
+get_char(struct dhl_parser *p)
+{
+	int c;
+
+	if (p->err != DHL_OK || p->pos >= p->len)
+		return -1;
+
+	c = (unsigned char)p->buf[p->pos++];
+
+	/*
+		The inblock is not set by the matching '{' but rather as soon as the
+		"lease" token is encountered. There is still syntax checking for the
+		'{', though.
+	*/
+	if (c == CHAR_CURLY_BRACE_END) {
+		if (!p->inblock) {
+			set_error(p, DHL_ESYNTAX, "unbalanced bracket at line %d, pos %d", p->line, p->cpos);
+			return -1;
+		}
+		p->inblock = 0;
+		end_lease(p);
+	}
+
+	if (c == '\n') {
+		p->line++;
+		p->cpos = 0;
+	}
+	p->cpos++;
+
+	return c;
+}
+
+
+/*
+ * Jump to the desired character in the same line.
+ * The character must be found or the parsing run will fail
+ */
+static int
+seek_char(struct dhl_parser *p, const unsigned char chr)
+{
+	int c;
+
+	do {
+		c = get_char(p);
+		if (c == chr)
+			return DHL_OK;
+
+		if (c == -1 || c == '\n')
+			return set_error(p, DHL_ESYNTAX, "missing '%c' in line %d", chr, p->line);
+	} while (1);
+}
+
+
+/*
+ * Record the span up to the next ';'
+ */
+static int
+scan_to_semicolon(struct dhl_parser *p, struct dhl_field *f)
+{
+	size_t start;
+	int c;
+
+	start = p->pos;
+	do {
+		c = get_char(p);
+		if (c == -1)
+			return set_error(p, DHL_ESYNTAX, "unexpected EOF at line %d, pos %d", p->line, p->cpos);
+
+		if (c == '\n')
+			return set_error(p, DHL_ESYNTAX, "unexpected newline at line %d, pos %d, expected ';'", p->line, p->cpos);
+	} while (c != CHAR_SEMICOLON);
+
+	f->ptr = p->buf + start;
+	f->len = p->pos - 1 - start;
+	return DHL_OK;
+}
+
+
+/*
+ * Record the span of a single word such as an IP address, a MAC
+ * address or a quoted client hostname
+ */
+static int
+scan_word(struct dhl_parser *p, int quoted, struct dhl_field *f)
+{
+	size_t start;
+	int c;
+
+	start = p->pos;
+	do {
+		c = get_char(p);
+		if (c == -1)
+			return set_error(p, DHL_ESYNTAX, "unexpected EOF at line %d, pos %d", p->line, p->cpos);
+
+		if (c == '\n')
+			return set_error(p, DHL_ESYNTAX, "unexpected newline at line %d, pos %d", p->line, p->cpos);
+	} while (!(isspace(c) || c == CHAR_SEMICOLON || (c == '"' && !quoted)));
+
+	f->ptr = p->buf + start;
+	f->len = p->pos - 1 - start;
+
+	/* Leave out the surrounding quotes */
+	if (quoted && f->len > 0 && f->ptr[0] == '"') {
+		f->ptr++;
+		f->len--;
+	}
+	if (quoted && f->len > 0 && f->ptr[f->len - 1] == '"')
+		f->len--;
+
+	if (f->len >= DHL_BUFSIZE)
+		return set_error(p, DHL_ESYNTAX, "value too long at line %d", p->line);
+	return DHL_OK;
+}
+
+
+/*
+ * Record the span of a date.  It is only converted when needed.
+ */
+static int
+scan_date(struct dhl_parser *p, struct dhl_field *f)
+{
+	if (scan_to_semicolon(p, f) != DHL_OK)
+		return p->err;
+
+	if (f->len < 3)
+		return set_error(p, DHL_EDATE, "weird date at line %d", p->line);
+	return DHL_OK;
+}
+
+
+static int
+check_block_scope(struct dhl_parser *p)
+{
+	if (!p->inblock)
+		return set_error(p, DHL_ESYNTAX, "element '%s' found outside block scope at line %d", p->buffer, p->line);
+	return DHL_OK;
+}
+
+
+/*
+ * Look for the next token by scanning bytes until we reach a boundary
+ * and then check if the string is a valid (supported) token
+ */
+static int
+get_token(struct dhl_parser *p)
+{
+	size_t i;
+	int c, kwl;
+
+	i = 0;
+	p->buffer[0] = '\0';
+
+	do {
+		c = get_char(p);
+		if (c == -1) {
+			p->buffer[i] = '\0';
+			return TOK_INVALID_TOKEN;
+		}
+
+		if (isspace(c) || c == CHAR_SEMICOLON)
+			break;
+
+		/* Skip comments up to the end of the line */
+		if (c == '#') {
+			do {
+				c = get_char(p);
+			} while (c != '\n' && c != -1);
+			break;
+		}
+
+		if (i >= sizeof(p->buffer) - 1) {
+			set_error(p, DHL_ESYNTAX, "token too long at line %d", p->line);
+			return TOK_INVALID_TOKEN;
+		}
+		p->buffer[i++] = c;
+	} while (1);
+	p->buffer[i] = '\0';
+
+	/* Check if we have a token */
+	kwl = lookup(p->buffer);
+	if (kwl <= TOK_INVALID_TOKEN)
+		return TOK_INVALID_TOKEN;
+
+	p->count++;
+	return kwl;
+}
+
+
+static int
+keyword_cmp(const void *p1, const void *p2)
+{
+	return (strcasecmp(p1, ((const struct keywords *)p2)->name));
+}
+
+
+static int
+lookup(const char *value)
+{
+	const struct keywords *p;
+
+	p = bsearch(value, keywords, sizeof(keywords) / sizeof(keywords[0]),
+		sizeof(keywords[0]), keyword_cmp);
+
+	if (p)
+		return (p->value);
+	return TOK_INVALID_TOKEN;
+}
+
+
+/*
+ * Scan the buffer set up in the parser, picking up where the last call
+ * left off
+ */
+static int
+scan(struct dhl_parser *p)
+{
+	struct dhl_lease *l = &p->lease;
+	struct dhl_field skip;
+	int token;
+
+	while (p->err == DHL_OK && p->pos < p->len) {
+		token = get_token(p);
+		if (p->err != DHL_OK)
+			break;
+
+		/* We have just finished a block and found the closing curly brace */
+		if (!p->inblock && p->buffer[0] == CHAR_CURLY_BRACE_END)
+			continue;
+
+		if (p->count == 1 && token != TOK_INVALID_TOKEN && token != TOK_LEASE)
+			return set_error(p, DHL_ESYNTAX, "expected a 'lease' section, got '%s' at line %d", p->buffer, p->line);
+
+		if (token != TOK_INVALID_TOKEN && token != TOK_LEASE && !p->inblock)
+			return set_error(p, DHL_ESYNTAX, "found token '%s' outside lease boundaries at line %d", p->buffer, p->line);
+
+		switch (token) {
+			/* Get assigned IP address, ensure syntax */
+			case TOK_LEASE:
+				if (p->inblock)
+					return set_error(p, DHL_ESYNTAX, "lease section began inside existing lease section at line %d", p->line);
+				p->inblock = 1;
+				begin_lease(p);
+				if (scan_word(p, 0, &l->raw_ipaddr) == DHL_OK)
+					seek_char(p, CHAR_CURLY_BRACE_START);
+				break;
+
+			case TOK_STARTS:
+				if (check_block_scope(p) == DHL_OK)
+					scan_date(p, &l->raw_starts);
+				break;
+
+			case TOK_ENDS:
+				if (check_block_scope(p) == DHL_OK)
+					scan_date(p, &l->raw_ends);
+				break;
+
+			case TOK_HARDWARE:
+				if (check_block_scope(p) != DHL_OK)
+					break;
+				if (get_token(p) != TOK_ETHERNET)
+					break;
+				scan_word(p, 0, &l->raw_macaddr);
+				break;
+
+			case TOK_CLIENT_HOSTNAME:
+				if (check_block_scope(p) == DHL_OK)
+					scan_word(p, 1, &l->raw_hostname);
+				break;
+
+			/* Check if the lease is abandoned */
+			case TOK_ABANDONED:
+				l->abandoned = 1;
+				break;
+
+			case TOK_BINDING:
+				if (check_block_scope(p) != DHL_OK)
+					break;
+				/* Not a keyword of its own, failover state blocks use it too */
+				get_token(p);
+				if (strcasecmp(p->buffer, "state") != 0)
+					break;
+				if (scan_word(p, 0, &l->raw_state) != DHL_OK)
+					break;
+				/* Newer dhcpd versions mark abandoned leases this way */
+				if (l->raw_state.len == 9 && strncasecmp(l->raw_state.ptr, "abandoned", 9) == 0)
+					l->abandoned = 1;
+				break;
+
+			/*
+			 * The state a lease moves to next, or was in before a
+			 * failover rewind, is not the state it is in: swallow the
+			 * whole "binding state <state>" so that neither the
+			 * binding state nor abandoned is taken from it
+			 */
+			case TOK_NEXT:
+			case TOK_REWIND:
+				if (check_block_scope(p) != DHL_OK)
+					break;
+				if (get_token(p) != TOK_BINDING)
+					break;
+				get_token(p);
+				if (strcasecmp(p->buffer, "state") == 0)
+					scan_word(p, 0, &skip);
+				break;
+
+			default:
+				;
+		}
+	}
+
+	return p->err;
+}
+
+
+struct dhl_parser *
+dhl_parser_new(void)
+{
+	return calloc(1, sizeof(struct dhl_parser));
+}
+
+
+void
+dhl_parser_free(struct dhl_parser *p)
+{
+	free(p->rbuf);
+	free(p);
+}
+
+
+/*
+ * In lazy mode leases are handed to the callback with only their raw
+ * fields set, leaving any decoding to the caller
+ */
+void
+dhl_parser_setlazy(struct dhl_parser *p, int lazy)
+{
+	p->lazy = lazy;
+}
+
+
+/*
+ * Parse a lease file held in memory, calling cb for every lease.
+ * Returns DHL_OK or one of the DHL_E* error codes, in which case
+ * dhl_parser_error() describes what went wrong.
+ */
+int
+dhl_parse_buffer(struct dhl_parser *p, const char *buf, size_t len, dhl_lease_cb cb, void *arg)
+{
+	reset(p, cb, arg);
+	p->buf = buf;
+	p->len = len;
+
+	return scan(p);
+}
+
+
+/*
+ * Continue parsing with the next part of the same lease file, which
+ * must start on a lease block boundary.  Leases go to the callback
+ * given to the dhl_parse_buffer() call which started the file, and line
+ * numbers carry on from where the previous part ended.
+ */
+int
+dhl_parse_next(struct dhl_parser *p, const char *buf, size_t len)
+{
+	if (p->err != DHL_OK)
+		return p->err;
+
+	p->buf = buf;
+	p->len = len;
+	p->pos = 0;
+
+	return scan(p);
+}
+
+
+/*
+ * Parse a lease file from an open stream.  The stream is read in large
+ * chunks, each cut after the last closing curly brace in it so that no
+ * lease block straddles two chunks.  See dhl_parse_buffer().
+ */
+int
+dhl_parse_file(struct dhl_parser *p, FILE *fp, dhl_lease_cb cb, void *arg)
+{
+	size_t have, cut, n;
+	char *tmp;
+
+	reset(p, cb, arg);
+
+	have = 0;
+	do {
+		if (have == p->rsize) {
+			if ((tmp = realloc(p->rbuf, p->rsize + DHL_READSIZE)) == NULL)
+				return set_error(p, DHL_EIO, "out of memory reading lease file");
+			p->rbuf = tmp;
+			p->rsize += DHL_READSIZE;
+		}
+
+		n = fread(p->rbuf + have, 1, p->rsize - have, fp);
+		if (n == 0 && ferror(fp))
+			return set_error(p, DHL_EIO, "failed to read from lease file: %s", strerror(errno));
+		have += n;
+
+		/* At the end of the file everything left is scanned */
+		cut = have;
+		if (n != 0) {
+			while (cut > 0 && p->rbuf[cut - 1] != CHAR_CURLY_BRACE_END)
+				cut--;
+			if (cut == 0)
+				continue;
+		}
+
+		if (dhl_parse_next(p, p->rbuf, cut) != DHL_OK)
+			break;
+
+		memmove(p->rbuf, p->rbuf + cut, have - cut);
+		have -= cut;
+	} while (n != 0);
+
+	return p->err;
+}
+
+
+/*
+ * Open and parse the lease file at path.  See dhl_parse_file().
+ */
+int
+dhl_parse_path(struct dhl_parser *p, const char *path, dhl_lease_cb cb, void *arg)
+{
+	FILE *fp;
+	int err;
+
+	p->err = DHL_OK;
+	if ((fp = fopen(path, "r")) == NULL)
+		return set_error(p, DHL_EIO, "couldn't open lease file %s: %s", path, strerror(errno));
+
+	err = dhl_parse_file(p, fp, cb, arg);
+	fclose(fp);
+
+	return err;
+}
+
+
+/*
+ * Describes the last error of the parser, including its location
+ */
+const char *
+dhl_parser_error(const struct dhl_parser *p)
+{
+	if (p->err == DHL_OK)
+		return errstr[DHL_OK];
+	return p->errmsg;
+}
+
+
+int
+dhl_parser_line(const struct dhl_parser *p)
+{
+	return p->line;
+}
+
+
+const char *
+dhl_strerror(int err)
+{
+	if (err < 0 || (size_t)err >= sizeof(errstr) / sizeof(errstr[0]))
+		return "unknown error";
+	return errstr[err];
+}
+
+
+/*
+ * Copy a raw field into dst as a NUL-terminated string, leaving out
+ * quotes and non-ASCII bytes.  Returns the length of the string.
+ */
+size_t
+dhl_field_copy(const struct dhl_field *f, char *dst, size_t size)
+{
+	size_t i, n;
+
+	n = 0;
+	for (i = 0; f->ptr != NULL && i < f->len && n + 1 < size; i++) {
+		if (f->ptr[i] == '"' || !isascii((unsigned char)f->ptr[i]))
+			continue;
+		dst[n++] = f->ptr[i];
+	}
+	if (size > 0)
+		dst[n] = '\0';
+
+	return n;
+}
+
+
+/*
+ * Convert a raw date field, getting rid of the prepended weekday which
+ * we don't need.  A date of "never" becomes DHL_NEVER.  Returns DHL_OK
+ * or DHL_EDATE.
+ */
+int
+dhl_field_time(const struct dhl_field *f, time_t *t)
+{
+	char datebuf[64];
+	const char *datestr;
+	struct tm tm;
+
+	dhl_field_copy(f, datebuf, sizeof(datebuf));
+
+	if (strcmp(datebuf, "never") == 0) {
+		*t = DHL_NEVER;
+		return DHL_OK;
+	}
+
+	datestr = datebuf;
+	if (isdigit((unsigned char)datestr[0]) && isspace((unsigned char)datestr[1]))
+		datestr += 2;
+
+	memset(&tm, 0, sizeof(tm));
+	if (strptime(datestr, "%Y/%m/%d %H:%M:%S", &tm) == NULL)
+		return DHL_EDATE;
+
+	/* Let mktime() work out daylight saving time on its own */
+	tm.tm_isdst = -1;
+	*t = mktime(&tm);
+	return DHL_OK;
+}
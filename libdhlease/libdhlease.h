@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2018, Klaus Pedersen <klaus@brightstorm.net>
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+1. Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+2. Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+The views and conclusions contained in the software and documentation are those
+of the authors and should not be interpreted as representing official policies,
+either expressed or implied, of the DHLEASE project.
+*/
+
+#ifndef _LIBDHLEASE_H_
+#define _LIBDHLEASE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* Error codes returned by the parser */
+#define DHL_OK			0
+#define DHL_EIO			1	/* lease file could not be opened or read */
+#define DHL_ESYNTAX		2	/* malformed lease file */
+#define DHL_EDATE		3	/* date could not be converted */
+#define DHL_EABORT		4	/* callback asked to stop */
+
+/* Time given for a date of "never", as infinite leases end */
+#define DHL_NEVER		((time_t)(sizeof(time_t) == 8 ? INT64_MAX : INT32_MAX))
+
+/* Chunk size dhl_parse_file() reads the lease file in */
+#define DHL_READSIZE		(1024 * 1024)
+
+/*
+ * A raw lease field: the span of the lease file holding its value,
+ * without surrounding quotes and not NUL-terminated.  ptr is NULL if
+ * the lease block did not carry the field.
+ */
+struct dhl_field {
+	const char	*ptr;
+	size_t		len;
+};
+
+/*
+ * A single lease as handed to the callback.  The strings belong to the
+ * parser and are only valid until the callback returns; copy whatever
+ * needs to be kept.  macaddr, hostname and state are NULL if the lease
+ * block did not carry them.  state is the binding state, such as
+ * "active" or "free"; abandoned is also set for leases in the
+ * "abandoned" binding state.
+ *
+ * The raw fields are always filled in.  They point into the buffer
+ * given to dhl_parse_buffer() and stay valid as long as it does; with
+ * dhl_parse_file() they are only valid until the callback returns.  In
+ * lazy mode, see dhl_parser_setlazy(), only the raw fields and
+ * abandoned are set and the caller decodes what it needs with
+ * dhl_field_copy() and dhl_field_time().
+ */
+struct dhl_lease {
+	time_t		starts;
+	time_t		ends;
+	const char	*ipaddr;
+	const char	*macaddr;
+	const char	*hostname;
+	const char	*state;
+	int		abandoned;
+
+	struct dhl_field raw_starts;
+	struct dhl_field raw_ends;
+	struct dhl_field raw_ipaddr;
+	struct dhl_field raw_macaddr;
+	struct dhl_field raw_hostname;
+	struct dhl_field raw_state;
+};
+
+/*
+ * Called once for every complete lease block, in file order.  Returning
+ * non-zero stops parsing with DHL_EABORT.
+ */
+typedef int (*dhl_lease_cb)(const struct dhl_lease *lease, void *arg);
+
+struct dhl_parser;
+
+struct dhl_parser	*dhl_parser_new(void);
+void			dhl_parser_free(struct dhl_parser *p);
+void			dhl_parser_setlazy(struct dhl_parser *p, int lazy);
+int			dhl_parse_buffer(struct dhl_parser *p, const char *buf, size_t len, dhl_lease_cb cb, void *arg);
+int			dhl_parse_next(struct dhl_parser *p, const char *buf, size_t len);
+int			dhl_parse_file(struct dhl_parser *p, FILE *fp, dhl_lease_cb cb, void *arg);
+int			dhl_parse_path(struct dhl_parser *p, const char *path, dhl_lease_cb cb, void *arg);
+const char		*dhl_parser_error(const struct dhl_parser *p);
+int			dhl_parser_line(const struct dhl_parser *p);
+const char		*dhl_strerror(int err);
+size_t			dhl_field_copy(const struct dhl_field *f, char *dst, size_t size);
+int			dhl_field_time(const struct dhl_field *f, time_t *t);
+
+#endif /* !_LIBDHLEASE_H_ */